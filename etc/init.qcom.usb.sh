@@ -29,19 +29,47 @@
 #
 
 # Set platform variables
-soc_hwplatform=`cat /sys/devices/soc0/hw_platform 2> /dev/null`
-soc_machine=`cat /sys/devices/soc0/machine 2> /dev/null`
-soc_machine=${soc_machine:0:2}
-soc_id=`cat /sys/devices/soc0/soc_id 2> /dev/null`
+# sysfs nodes are read with the read builtin, this runs early in boot and
+# every cat would be a fork. The soc0 nodes and the board platform never
+# change on a device, once the gadget HAL has saved a snapshot of the last
+# composition they are read from what an earlier boot found instead. The
+# cache is key=value lines that are only ever parsed, never sourced, as the
+# directory is writable by group system. The magic is SNAPSHOT_MAGIC of
+# UsbGadget.cpp, a snapshot of another format drops the cache as well.
+platform_cache=/data/vendor/usb/platform.cache
+platform_cached=0
+read -r -N 8 snapshot_magic 2> /dev/null < /data/vendor/usb/g1.snapshot
+if [ "$snapshot_magic" == "USBGSNP3" -a -f $platform_cache ]; then
+	while IFS== read -r key value; do
+		case "$key" in
+		"soc_hwplatform") soc_hwplatform=$value ;;
+		"soc_machine") soc_machine=$value ;;
+		"soc_id") soc_id=$value ;;
+		"target") target=$value ;;
+		"machine_type") machine_type=$value ;;
+		"msm_serial_hex") msm_serial_hex=$value ;;
+		esac
+	done < $platform_cache
+	# The serial is written last, a cache cut short is probed again.
+	if [ "$msm_serial_hex" != "" ]; then
+		platform_cached=1
+	fi
+fi
+if [ $platform_cached == 0 ]; then
+	read -r soc_hwplatform 2> /dev/null < /sys/devices/soc0/hw_platform
+	read -r soc_machine 2> /dev/null < /sys/devices/soc0/machine
+	machine_type=$soc_machine
+	soc_machine=${soc_machine:0:2}
+	read -r soc_id 2> /dev/null < /sys/devices/soc0/soc_id
+	target=`getprop ro.board.platform`
+fi
 
 #
 # Check ESOC for external modem
 #
 # Note: currently only a single MDM/SDX is supported
 #
-esoc_name=`cat /sys/bus/esoc/devices/esoc0/esoc_name 2> /dev/null`
-
-target=`getprop ro.board.platform`
+read -r esoc_name 2> /dev/null < /sys/bus/esoc/devices/esoc0/esoc_name
 
 #
 # Override USB default composition
@@ -127,7 +155,7 @@ fi
 case "$soc_machine" in
     "SA")
 	if [ -f /sys/bus/platform/devices/a600000.ssusb/mode ]; then
-	    default_mode=`cat /sys/bus/platform/devices/a600000.ssusb/mode`
+	    read -r default_mode < /sys/bus/platform/devices/a600000.ssusb/mode
 	    case "$default_mode" in
 		"none")
 		    echo peripheral > /sys/bus/platform/devices/a600000.ssusb/mode
@@ -140,13 +168,18 @@ esac
 # check configfs is mounted or not
 if [ -d /config/usb_gadget ]; then
 	# Chip-serial is used for unique MSM identification in Product string
-	msm_serial=`cat /sys/devices/soc0/serial_number`;
-	msm_serial_hex=`printf %08X $msm_serial`
-	machine_type=`cat /sys/devices/soc0/machine`
+	if [ $platform_cached == 0 ]; then
+		read -r msm_serial < /sys/devices/soc0/serial_number
+		msm_serial_hex=`printf %08X $msm_serial`
+		# Read back by the next boots, see above.
+		printf '%s\n' "soc_hwplatform=$soc_hwplatform" "soc_machine=$soc_machine" \
+		    "soc_id=$soc_id" "target=$target" "machine_type=$machine_type" \
+		    "msm_serial_hex=$msm_serial_hex" 2> /dev/null > $platform_cache
+	fi
 	setprop vendor.usb.product_string "$machine_type-$soc_hwplatform _SN:$msm_serial_hex"
 
 	# ADB requires valid iSerialNumber; if ro.serialno is missing, use dummy
-	serialnumber=`cat /config/usb_gadget/g1/strings/0x409/serialnumber 2> /dev/null`
+	read -r serialnumber 2> /dev/null < /config/usb_gadget/g1/strings/0x409/serialnumber
 	if [ "$serialnumber" == "" ]; then
 		serialno=1234567
 		echo $serialno > /config/usb_gadget/g1/strings/0x409/serialnumber
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define LOG_TAG "android.hardware.usb.gadget@1.0-service-qti"
+
+#include "ConfigFs.h"
+#include "FsRoot.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+using android::base::unique_fd;
+
+ConfigFs::ConfigFs(const std::string &gadget)
+    : mGadget(gadget),
+      mDirs{"", "configs/b.1/", "functions/"},
+      mOps(0),
+      mErrors(0) {}
+
+int ConfigFs::dirFd(Dir dir) {
+  std::lock_guard<std::mutex> lock(mLock);
+
+  if (mFds[dir] < 0)
+    mFds[dir].reset(::open(fsPath(mGadget + mDirs[dir]).c_str(),
+                           O_PATH | O_DIRECTORY | O_CLOEXEC));
+
+  return mFds[dir];
+}
+
+int ConfigFs::resolve(const std::string &path, std::string *name) {
+  if (!path.empty() && path[0] != '/') {
+    // Most specific first, configs/ and functions/ are under the gadget.
+    for (Dir dir : {CONFIG, FUNCTIONS, GADGET}) {
+      const std::string &prefix = mDirs[dir];
+
+      if (path.size() <= prefix.size() || path.compare(0, prefix.size(), prefix))
+        continue;
+
+      int fd = dirFd(dir);
+      if (fd < 0) break;
+
+      name->assign(path, prefix.size(), std::string::npos);
+      return fd;
+    }
+
+    *name = fsPath(mGadget + path);
+    return AT_FDCWD;
+  }
+
+  *name = fsPath(path);
+  return AT_FDCWD;
+}
+
+int ConfigFs::failed(const char *op, const std::string &path, int error) {
+  mErrors++;
+  ALOGE("configfs %s %s%s failed errno:%d", op, path[0] == '/' ? "" : mGadget.c_str(),
+        path.c_str(), error);
+  return error;
+}
+
+int ConfigFs::write(const std::string &path, const std::string &value) {
+  std::string name;
+  int dir = resolve(path, &name);
+
+  mOps++;
+  unique_fd fd(openat(dir, name.c_str(), O_WRONLY | O_CLOEXEC));
+  if (fd < 0) return failed("open", path, errno);
+
+  // configfs stores an attribute in a single write, a short one is an error.
+  ssize_t written = TEMP_FAILURE_RETRY(::write(fd, value.data(), value.size()));
+  if (written < 0) return failed("write", path, errno);
+  if ((size_t)written != value.size()) return failed("write", path, EIO);
+
+  return 0;
+}
+
+int ConfigFs::read(const std::string &path, std::string *value) {
+  std::string name;
+  int dir = resolve(path, &name);
+  char buf[256];
+  ssize_t n;
+
+  mOps++;
+  unique_fd fd(openat(dir, name.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) return failed("open", path, errno);
+
+  value->clear();
+  while ((n = TEMP_FAILURE_RETRY(::read(fd, buf, sizeof(buf)))) > 0)
+    value->append(buf, n);
+  if (n < 0) return failed("read", path, errno);
+
+  return 0;
+}
+
+int ConfigFs::mkdir(const std::string &path) {
+  std::string name;
+  int dir = resolve(path, &name);
+
+  mOps++;
+  if (mkdirat(dir, name.c_str(), 0770) && errno != EEXIST)
+    return failed("mkdir", path, errno);
+
+  return 0;
+}
+
+int ConfigFs::link(const std::string &target, const std::string &name) {
+  int dir = dirFd(CONFIG);
+
+  mOps++;
+  if (dir < 0) return failed("open", mDirs[CONFIG], errno);
+  // configfs resolves the target itself, it has to be the full path.
+  if (symlinkat(fsPath(mGadget + target).c_str(), dir, name.c_str()))
+    return failed("symlink", mDirs[CONFIG] + name, errno);
+
+  return 0;
+}
+
+int ConfigFs::unlink(const std::string &name) {
+  int dir = dirFd(CONFIG);
+
+  mOps++;
+  if (dir < 0) return failed("open", mDirs[CONFIG], errno);
+  if (unlinkat(dir, name.c_str(), 0)) return failed("unlink", mDirs[CONFIG] + name, errno);
+
+  return 0;
+}
+
+int ConfigFs::listConfig(std::vector<std::string> *names) {
+  int dir = dirFd(CONFIG);
+  struct dirent *entry;
+
+  mOps++;
+  names->clear();
+  if (dir < 0) return failed("open", mDirs[CONFIG], errno);
+
+  // O_PATH fds cannot be read from, the listing needs one of its own.
+  int fd = openat(dir, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return failed("open", mDirs[CONFIG], errno);
+
+  std::unique_ptr<DIR, int (*)(DIR *)> config(fdopendir(fd), closedir);
+  if (!config) {
+    int error = errno;
+    close(fd);
+    return failed("opendir", mDirs[CONFIG], error);
+  }
+
+  while ((entry = readdir(config.get())) != NULL)
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+      names->push_back(entry->d_name);
+
+  return 0;
+}
+
+unique_fd ConfigFs::open(const std::string &path, int flags) {
+  std::string name;
+  int dir = resolve(path, &name);
+
+  mOps++;
+  return unique_fd(openat(dir, name.c_str(), flags | O_CLOEXEC));
+}
+
+void ConfigFs::dump(int fd) const {
+  dprintf(fd, "configfs %s: %" PRIu64 " operations %" PRIu64 " failed\n", mGadget.c_str(),
+          mOps.load(), mErrors.load());
+}
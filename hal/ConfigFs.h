@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VENDOR_QCOM_USB_CONFIG_FS_H
+#define VENDOR_QCOM_USB_CONFIG_FS_H
+
+#include <android-base/unique_fd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * configfs I/O of one gadget relative to O_PATH fds of its directory,
+ * configs/b.1/ and functions/, so that an attribute write costs an
+ * openat() of a single component rather than a walk of the full path.
+ * Paths are relative to the gadget directory, like "UDC" or
+ * "functions/ffs.adb", absolute ones are resolved against fsRoot().
+ *
+ * Operations return 0 or the errno of the failing call and log it. The fds
+ * are opened on first use and kept, so the methods are safe to call from
+ * the worker and the FunctionFS monitor at the same time.
+ */
+class ConfigFs {
+ public:
+  // gadget is the directory of the gadget with a trailing slash
+  explicit ConfigFs(const std::string &gadget);
+  ConfigFs(const ConfigFs &) = delete;
+  ConfigFs &operator=(const ConfigFs &) = delete;
+
+  int write(const std::string &path, const std::string &value);
+  int read(const std::string &path, std::string *value);
+  int mkdir(const std::string &path);
+  // Links the function directory target, like "functions/ffs.adb", into
+  // configs/b.1/ as name.
+  int link(const std::string &target, const std::string &name);
+  // Removes the link name from configs/b.1/.
+  int unlink(const std::string &name);
+  // Names of the entries of configs/b.1/
+  int listConfig(std::vector<std::string> *names);
+  // Opens path for flags, setting errno on failure like open().
+  android::base::unique_fd open(const std::string &path, int flags);
+
+  void dump(int fd) const;
+
+ private:
+  enum Dir { GADGET, CONFIG, FUNCTIONS, DIRS };
+
+  int dirFd(Dir dir);
+  // The held dir path is under, with name set to the rest of the path.
+  // AT_FDCWD with name set to the rooted path for absolute paths.
+  int resolve(const std::string &path, std::string *name);
+  int failed(const char *op, const std::string &path, int error);
+
+  const std::string mGadget;
+  // Held directories relative to mGadget
+  const std::string mDirs[DIRS];
+  std::mutex mLock;
+  android::base::unique_fd mFds[DIRS];
+
+  std::atomic<uint64_t> mOps;
+  std::atomic<uint64_t> mErrors;
+};
+
+#endif  // VENDOR_QCOM_USB_CONFIG_FS_H
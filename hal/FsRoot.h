@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VENDOR_QCOM_USB_FS_ROOT_H
+#define VENDOR_QCOM_USB_FS_ROOT_H
+
+#include <string>
+
+/*
+ * Directory the sysfs, configfs, devfs and /vendor/etc paths of the HALs
+ * are resolved against. Empty on a device, where the paths are used as is.
+ * Set with setFsRoot() before the HAL objects are created to run them
+ * against a generated tree instead.
+ */
+inline std::string &fsRoot() {
+  static std::string root;
+  return root;
+}
+
+inline void setFsRoot(const std::string &root) {
+  fsRoot() = root;
+}
+
+// path resolved against fsRoot()
+inline std::string fsPath(const std::string &path) {
+  return fsRoot() + path;
+}
+
+// Inverse of fsPath() for paths that were resolved on the tree, like the
+// result of realpath().
+inline std::string fsUnroot(const std::string &path) {
+  const std::string &root = fsRoot();
+
+  if (!root.empty() && !path.compare(0, root.size(), root))
+    return path.substr(root.size());
+
+  return path;
+}
+
+#endif  // VENDOR_QCOM_USB_FS_ROOT_H
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VENDOR_QCOM_USB_LATENCY_STATS_H
+#define VENDOR_QCOM_USB_LATENCY_STATS_H
+
+#include <atomic>
+#include <cutils/trace.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+// Every power of two of microseconds is split into this many buckets.
+#define LATENCY_SUB_BUCKETS 4
+// Enough for anything up to 2^32 us, longer durations end up in the last one.
+#define LATENCY_BUCKETS (31 * LATENCY_SUB_BUCKETS)
+
+static inline uint64_t latencyNowUs() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Durations of one operation in microseconds. Buckets are a quarter of a
+ * power of two wide, so percentiles are reported within 25% of the actual
+ * value. Recorded and dumped without locks.
+ */
+struct LatencyHistogram {
+  explicit LatencyHistogram(const char *name)
+      : name(name), count(0), totalUs(0), maxUs(0), buckets() {}
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  static int bucket(uint64_t us) {
+    if (us < LATENCY_SUB_BUCKETS)
+      return us;
+
+    int msb = 63 - __builtin_clzll(us);
+    int index = (msb - 1) * LATENCY_SUB_BUCKETS + ((us >> (msb - 2)) & (LATENCY_SUB_BUCKETS - 1));
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+  }
+
+  // Largest duration that falls into bucket index
+  static uint64_t bucketLimit(int index) {
+    if (index < LATENCY_SUB_BUCKETS)
+      return index;
+
+    int shift = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+  }
+
+  void record(uint64_t us) {
+    uint64_t max = maxUs.load(std::memory_order_relaxed);
+
+    count.fetch_add(1, std::memory_order_relaxed);
+    totalUs.fetch_add(us, std::memory_order_relaxed);
+    buckets[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    while (us > max && !maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed))
+      ;
+  }
+
+  // Upper bound of the duration below which percent of the samples fall
+  uint64_t percentile(unsigned percent) const {
+    uint64_t samples = 0;
+    uint64_t target;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+      samples += buckets[i].load(std::memory_order_relaxed);
+    if (samples == 0)
+      return 0;
+
+    target = (samples * percent + 99) / 100;
+    samples = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      samples += buckets[i].load(std::memory_order_relaxed);
+      if (samples >= target)
+        return bucketLimit(i);
+    }
+
+    return maxUs.load(std::memory_order_relaxed);
+  }
+
+  void dump(int fd) const {
+    uint64_t samples = count.load(std::memory_order_relaxed);
+
+    dprintf(fd, "%s: count %" PRIu64, name, samples);
+    if (samples)
+      dprintf(fd, " p50 %" PRIu64 "us p95 %" PRIu64 "us p99 %" PRIu64 "us max %" PRIu64
+              "us mean %" PRIu64 "us", percentile(50), percentile(95), percentile(99),
+              maxUs.load(std::memory_order_relaxed),
+              totalUs.load(std::memory_order_relaxed) / samples);
+    dprintf(fd, "\n");
+  }
+
+  const char *const name;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> totalUs;
+  std::atomic<uint64_t> maxUs;
+  std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+};
+
+/*
+ * Times the enclosing scope into a histogram and marks it as a trace
+ * section named after the histogram, so that HAL timings line up with the
+ * dwc3 and ucsi tracepoints enabled by init.qti.usb.debug.sh.
+ */
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyHistogram *histogram)
+      : mHistogram(histogram), mStartUs(latencyNowUs()) {
+    atrace_begin(ATRACE_TAG_HAL, histogram->name);
+  }
+  ~ScopedLatency() {
+    atrace_end(ATRACE_TAG_HAL);
+    mHistogram->record(latencyNowUs() - mStartUs);
+  }
+  ScopedLatency(const ScopedLatency &) = delete;
+  ScopedLatency &operator=(const ScopedLatency &) = delete;
+
+ private:
+  LatencyHistogram *mHistogram;
+  uint64_t mStartUs;
+};
+
+#endif  // VENDOR_QCOM_USB_LATENCY_STATS_H
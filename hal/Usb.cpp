@@ -19,25 +19,38 @@
 
 #define LOG_TAG "android.hardware.usb@1.2-service-qti"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <assert.h>
 #include <chrono>
+#include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
-#include <regex>
 #include <stdio.h>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
 
 #include <cutils/uevent.h>
-#include <hidl/HidlTransportSupport.h>
+#include <linux/filter.h>
 #include <linux/usb/ch9.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <utils/Errors.h>
 #include <utils/StrongPointer.h>
 
+#include "FsRoot.h"
 #include "Usb.h"
 
 namespace android {
@@ -46,16 +59,21 @@ namespace usb {
 namespace V1_2 {
 namespace implementation {
 
-const char GOOGLE_USB_VENDOR_ID_STR[] = "18d1";
-const char GOOGLE_USBC_35_ADAPTER_UNPLUGGED_ID_STR[] = "5029";
-
 // Set by the signal handler to destroy the thread
 volatile bool destroyThread;
 
-static void checkUsbWakeupSupport(struct Usb *usb);
-static void checkUsbDeviceAutoSuspend(const std::string& devicePath);
-static bool checkUsbInterfaceAutoSuspend(const std::string& devicePath,
-        const std::string &intf);
+static void discoverPlatform(struct Usb *usb);
+static void inheritPlatform(struct Usb *usb, const struct Usb *live);
+static void *autoSuspendSweep(void *param);
+static int getPortNameIndex(const std::string &portName);
+static int attachUeventFilter(int uevent_fd);
+static pthread_mutex_t *getRoleSwitchLock(struct Usb *usb, const std::string &portName);
+static void loadAutoSuspendRules(struct Usb *usb);
+static void checkUsbDeviceAutoSuspend(struct Usb *usb, const std::string& devicePath);
+static const struct AutoSuspendRule *interfaceAutoSuspendRule(struct Usb *usb,
+        const std::string& devicePath, const std::string &intf);
+static int applyAutoSuspendRule(const std::string &devicePath,
+                                const struct AutoSuspendRule &rule);
 
 static int32_t readFile(const std::string &filename, std::string *contents) {
   FILE *fp;
@@ -63,7 +81,7 @@ static int32_t readFile(const std::string &filename, std::string *contents) {
   char *line = NULL;
   size_t len = 0;
 
-  fp = fopen(filename.c_str(), "r");
+  fp = fopen(fsPath(filename).c_str(), "r");
   if (fp != NULL) {
     if ((read = getline(&line, &len, fp)) != -1) {
       char *pos;
@@ -85,7 +103,7 @@ static int32_t writeFile(const std::string &filename,
   FILE *fp;
   int ret;
 
-  fp = fopen(filename.c_str(), "w");
+  fp = fopen(fsPath(filename).c_str(), "w");
   if (fp != NULL) {
     ret = fputs(contents.c_str(), fp);
     fclose(fp);
@@ -101,6 +119,124 @@ static int32_t writeFile(const std::string &filename,
   return -1;
 }
 
+/*
+ * Parses a hex number no larger than max, with an optional 0x prefix and
+ * nothing else. Does not throw or allocate.
+ */
+static bool parseHex(std::string_view str, unsigned long max, unsigned long *value) {
+  unsigned long result = 0;
+
+  if (str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+    str.remove_prefix(2);
+  if (str.empty())
+    return false;
+
+  for (unsigned char c : str) {
+    int digit = isdigit(c) ? c - '0' : isxdigit(c) ? tolower(c) - 'a' + 10 : -1;
+    if (digit < 0 || result > (max - digit) / 16)
+      return false;
+    result = result * 16 + digit;
+  }
+
+  *value = result;
+  return true;
+}
+
+// Reads a sysfs attribute holding a hex number, see parseHex().
+static bool readHexAttr(const std::string &path, unsigned long max, unsigned long *value) {
+  char buf[16];
+  int fd = open(fsPath(path).c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  if (len <= 0 || len == sizeof(buf))
+    return false;
+
+  std::string_view str(buf, len);
+  while (!str.empty() && isspace((unsigned char)str.back()))
+    str.remove_suffix(1);
+
+  return parseHex(str, max, value);
+}
+
+static const char *const portAttrNodes[PORT_ATTR_COUNT] = {
+  "/power_role",
+  "/data_role",
+  "/port_type",
+  "/power_operation_mode",
+  "-partner/accessory_mode",
+  "-partner/supports_usb_power_delivery",
+};
+
+PortAttrCache::PortAttrCache() {
+  for (int i = 0; i < PORT_ATTR_COUNT; i++)
+    fds[i] = -1;
+}
+
+PortAttrCache::~PortAttrCache() {
+  for (int i = 0; i < PORT_ATTR_COUNT; i++)
+    if (fds[i] >= 0) close(fds[i]);
+}
+
+static int openPortAttr(struct PortAttrCache *attrs, const std::string &portName,
+                        int attr) {
+  std::string filename = fsPath("/sys/class/typec/" + portName + portAttrNodes[attr]);
+
+  if (attrs->fds[attr] >= 0)
+    close(attrs->fds[attr]);
+
+  attrs->fds[attr] = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (attrs->fds[attr] < 0)
+    ALOGE("open failed in openPortAttr %s, errno=%d", filename.c_str(), errno);
+
+  return attrs->fds[attr];
+}
+
+static void closePartnerAttrs(struct PortAttrCache *attrs) {
+  for (int i = PORT_ATTR_PARTNER_FIRST; i < PORT_ATTR_COUNT; i++) {
+    if (attrs->fds[i] >= 0) close(attrs->fds[i]);
+    attrs->fds[i] = -1;
+  }
+}
+
+static void openPartnerAttrs(struct PortAttrCache *attrs, const std::string &portName) {
+  for (int i = PORT_ATTR_PARTNER_FIRST; i < PORT_ATTR_COUNT; i++)
+    openPortAttr(attrs, portName, i);
+}
+
+/*
+ * Reads a cached attribute into buf with the trailing newline stripped.
+ * Opens the node on first use, and once more if the held fd went stale
+ * because the sysfs node was removed and recreated underneath us.
+ */
+static int readPortAttr(struct PortAttrCache *attrs, const std::string &portName,
+                        int attr, char *buf, size_t len) {
+  ssize_t n = -1;
+
+  for (int tries = 0; tries < 2 && n < 0; tries++) {
+    if ((tries || attrs->fds[attr] < 0) && openPortAttr(attrs, portName, attr) < 0)
+      return -1;
+    n = pread(attrs->fds[attr], buf, len - 1, 0);
+  }
+
+  if (n < 0) {
+    ALOGE("pread failed in readPortAttr %s%s, errno=%d", portName.c_str(),
+          portAttrNodes[attr], errno);
+    close(attrs->fds[attr]);
+    attrs->fds[attr] = -1;
+    return -1;
+  }
+
+  buf[n] = '\0';
+  char *pos = strchr(buf, '\n');
+  if (pos != NULL) *pos = '\0';
+
+  return 0;
+}
+
 std::string appendRoleNodeHelper(const std::string &portName,
                                  PortRoleType type) {
   std::string node("/sys/class/typec/" + portName);
@@ -145,13 +281,26 @@ void extractRole(std::string *roleName) {
   }
 }
 
+// In-place variant of extractRole for attributes read into a stack buffer.
+static const char *extractRole(char *roleName) {
+  char *first = strchr(roleName, '[');
+  char *last = strchr(roleName, ']');
+
+  if (first != NULL && last != NULL && last > first) {
+    *last = '\0';
+    return first + 1;
+  }
+
+  return roleName;
+}
+
 void switchToDrp(const std::string &portName) {
   std::string filename =
       appendRoleNodeHelper(std::string(portName.c_str()), PortRoleType::MODE);
   FILE *fp;
 
   if (filename != "") {
-    fp = fopen(filename.c_str(), "w");
+    fp = fopen(fsPath(filename).c_str(), "w");
     if (fp != NULL) {
       int ret = fputs("dual", fp);
       fclose(fp);
@@ -178,13 +327,14 @@ bool switchMode(const hidl_string &portName,
     return false;
   }
 
-  fp = fopen(filename.c_str(), "w");
+  fp = fopen(fsPath(filename).c_str(), "w");
   if (fp != NULL) {
     // Hold the lock here to prevent loosing connected signals
     // as once the file is written the partner added signal
     // can arrive anytime.
     pthread_mutex_lock(&usb->mPartnerLock);
     usb->mPartnerUp = false;
+    uint64_t startUs = latencyNowUs();
     int ret = fputs(convertRoletoString(newRole).c_str(), fp);
     fclose(fp);
 
@@ -201,12 +351,14 @@ wait_again:
       // There are no uevent signals which implies role swap timed out.
       if (err == ETIMEDOUT) {
         ALOGI("uevents wait timedout");
+        usb->mModeSwitchTimeouts++;
       // Sanity check.
       } else if (!usb->mPartnerUp) {
         goto wait_again;
       // Role switch succeeded since usb->mPartnerUp is true.
       } else {
         roleSwitch = true;
+        usb->mSwitchModeLatency.record(latencyNowUs() - startUs);
       }
     } else {
       ALOGI("Role switch failed while wrting to file");
@@ -220,12 +372,158 @@ wait_again:
   return roleSwitch;
 }
 
-Usb::Usb()
-        : mLock(PTHREAD_MUTEX_INITIALIZER),
+static void notifyRoleSwitchStatus(struct Usb *usb, const hidl_string &portName,
+                                   const PortRole &newRole, bool roleSwitch) {
+  pthread_mutex_lock(&usb->mLock);
+  sp<V1_0::IUsbCallback> callback = usb->mCallback_1_0;
+  pthread_mutex_unlock(&usb->mLock);
+
+  if (callback != NULL) {
+    Return<void> ret =
+        callback->notifyRoleSwitchStatus(portName, newRole,
+        roleSwitch ? Status::SUCCESS : Status::ERROR);
+    if (!ret.isOk())
+      ALOGE("RoleSwitchStatus error %s", ret.description().c_str());
+  } else {
+    ALOGE("Not notifying the userspace. Callback is not set");
+  }
+}
+
+/*
+ * Arms mModeSwitchTimerFd for the earliest deadline of the pending port
+ * type switches, or disarms it if there are none. Caller must hold
+ * mPartnerLock.
+ */
+static int armModeSwitchTimerLocked(struct Usb *usb) {
+  struct itimerspec its = {};
+  uint64_t deadlineUs = 0;
+
+  if (usb->mModeSwitchTimerFd < 0)
+    return 0;
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    const struct PortInfo *port = &usb->mPorts[i];
+
+    if (port->modeSwitchPending && (!deadlineUs || port->modeSwitchDeadlineUs < deadlineUs))
+      deadlineUs = port->modeSwitchDeadlineUs;
+  }
+
+  // Same clock as latencyNowUs().
+  its.it_value.tv_sec = deadlineUs / 1000000;
+  its.it_value.tv_nsec = deadlineUs % 1000000 * 1000;
+  return timerfd_settime(usb->mModeSwitchTimerFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Writes the new port type of port idx and arms the deadline for the
+ * partner to come back. The worker thread reports the outcome. Returns
+ * false if the switch could not be started. Caller must hold mPartnerLock.
+ */
+static bool startModeSwitchLocked(const hidl_string &portName,
+                                  const PortRole &newRole, struct Usb *usb, int idx) {
+  struct PortInfo *port = &usb->mPorts[idx];
+  std::string filename =
+       appendRoleNodeHelper(std::string(portName.c_str()), newRole.type);
+  FILE *fp;
+  int ret;
+
+  fp = fopen(fsPath(filename).c_str(), "w");
+  if (fp == NULL)
+    return false;
+
+  usb->mPartnerUp = false;
+  port->modeSwitchStartUs = latencyNowUs();
+  ret = fputs(convertRoletoString(newRole).c_str(), fp);
+  fclose(fp);
+  if (ret == EOF) {
+    ALOGI("Role switch failed while wrting to file");
+    return false;
+  }
+
+  port->modeSwitchPending = true;
+  port->modeSwitchPort = portName;
+  port->modeSwitchRole = newRole;
+  port->modeSwitchDeadlineUs = port->modeSwitchStartUs + PORT_TYPE_TIMEOUT * 1000000ULL;
+  if (armModeSwitchTimerLocked(usb)) {
+    ALOGE("timerfd_settime failed for role switch; errno=%d", errno);
+    port->modeSwitchPending = false;
+    armModeSwitchTimerLocked(usb);
+    return false;
+  }
+
+  // Ends on the worker thread, see finishModeSwitch().
+  atrace_async_begin(ATRACE_TAG_HAL, usb->mSwitchModeLatency.name, idx);
+  return true;
+}
+
+/*
+ * Reports the outcome of the pending port type switch of port idx, if
+ * any. Runs on the worker thread once the partner is back or the deadline
+ * has expired.
+ */
+static void finishModeSwitch(struct Usb *usb, int idx, bool roleSwitch) {
+  struct PortInfo *port = &usb->mPorts[idx];
+  hidl_string portName;
+  PortRole newRole;
+
+  pthread_mutex_lock(&usb->mPartnerLock);
+  if (!port->modeSwitchPending) {
+    pthread_mutex_unlock(&usb->mPartnerLock);
+    return;
+  }
+  port->modeSwitchPending = false;
+  portName = port->modeSwitchPort;
+  newRole = port->modeSwitchRole;
+  armModeSwitchTimerLocked(usb);
+  atrace_async_end(ATRACE_TAG_HAL, usb->mSwitchModeLatency.name, idx);
+  if (roleSwitch)
+    usb->mSwitchModeLatency.record(latencyNowUs() - port->modeSwitchStartUs);
+  else
+    usb->mModeSwitchTimeouts++;
+  pthread_mutex_unlock(&usb->mPartnerLock);
+
+  if (!roleSwitch) {
+    ALOGI("uevents wait timedout");
+    switchToDrp(std::string(portName.c_str()));
+  }
+
+  notifyRoleSwitchStatus(usb, portName, newRole, roleSwitch);
+}
+
+Usb::Usb() : Usb(NULL) {}
+
+Usb::Usb(const Usb *live)
+        : mCallbackVersion(CALLBACK_NONE),
+          mLock(PTHREAD_MUTEX_INITIALIZER),
           mRoleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
           mPartnerLock(PTHREAD_MUTEX_INITIALIZER),
           mPartnerUp(false),
-          mContaminantPresence(false) {
+          mModeSwitchTimerFd(-1),
+          mIgnoreWakeup(false),
+          mAutoSuspendSwept(false),
+          mSelfPowered(false),
+          mMaxPowerFd(-1),
+          mAttributesFd(-1),
+          mPortsScanned(false),
+          mScanStatus(Status::SUCCESS),
+          mPortLock(PTHREAD_RWLOCK_INITIALIZER),
+          mDirtyPorts(0),
+          mRescanPending(false),
+          mSnapshotLock(PTHREAD_MUTEX_INITIALIZER),
+          mSnapshotGeneration(0),
+          mUeventsDelivered(0),
+          mUeventsHandled(0),
+          mUeventsFilterable(0),
+          mUeventFilterAttached(false),
+          mUeventFd(-1),
+          mReplay(NULL),
+          mReplayLock(PTHREAD_MUTEX_INITIALIZER),
+          mModeSwitchTimeouts(0),
+          mDryRun(live != NULL),
+          mSwitchRoleLatency("switchRole"),
+          mSwitchModeLatency("switchMode"),
+          mUeventLatency("uevent_event"),
+          mPortStatusLatency("getPortStatusHelper") {
     pthread_condattr_t attr;
     if (pthread_condattr_init(&attr)) {
         ALOGE("pthread_condattr_init failed: %s", strerror(errno));
@@ -239,11 +537,21 @@ Usb::Usb()
         ALOGE("pthread_cond_init failed: %s", strerror(errno));
         abort();
     }
+    if (pthread_cond_init(&mReplayCV, &attr))  {
+        ALOGE("pthread_cond_init failed: %s", strerror(errno));
+        abort();
+    }
     if (pthread_condattr_destroy(&attr)) {
         ALOGE("pthread_condattr_destroy failed: %s", strerror(errno));
         abort();
     }
 
+    if (live) {
+        inheritPlatform(this, live);
+        return;
+    }
+    discoverPlatform(this);
+    loadAutoSuspendRules(this);
 }
 
 
@@ -254,21 +562,42 @@ Return<void> Usb::switchRole(const hidl_string &portName,
   std::string written;
   FILE *fp;
   bool roleSwitch = false;
+  ScopedLatency latency(&mSwitchRoleLatency);
 
   if (filename == "") {
     ALOGE("Fatal: invalid node type");
     return Void();
   }
 
-  pthread_mutex_lock(&mRoleSwitchLock);
+  pthread_mutex_t *roleSwitchLock = getRoleSwitchLock(this, std::string(portName.c_str()));
+  pthread_mutex_lock(roleSwitchLock);
 
   ALOGI("filename write: %s role:%s", filename.c_str(),
         convertRoletoString(newRole).c_str());
 
   if (newRole.type == PortRoleType::MODE) {
+    int idx = getPortNameIndex(std::string(portName.c_str()));
+
+    pthread_mutex_lock(&mPartnerLock);
+    if (mModeSwitchTimerFd < 0 || idx < 0) {
+      // No worker thread or no port entry to complete the switch, wait for
+      // it here.
+      pthread_mutex_unlock(&mPartnerLock);
       roleSwitch = switchMode(portName, newRole, this);
+    } else if (mPorts[idx].modeSwitchPending) {
+      ALOGE("Role switch already in progress on %s", portName.c_str());
+      pthread_mutex_unlock(&mPartnerLock);
+    } else if (startModeSwitchLocked(portName, newRole, this, idx)) {
+      // Reported by the worker thread once the partner is back.
+      pthread_mutex_unlock(&mPartnerLock);
+      pthread_mutex_unlock(roleSwitchLock);
+      return Void();
+    } else {
+      pthread_mutex_unlock(&mPartnerLock);
+      switchToDrp(std::string(portName.c_str()));
+    }
   } else {
-    fp = fopen(filename.c_str(), "w");
+    fp = fopen(fsPath(filename).c_str(), "w");
     if (fp != NULL) {
       int ret = fputs(convertRoletoString(newRole).c_str(), fp);
       fclose(fp);
@@ -288,51 +617,39 @@ Return<void> Usb::switchRole(const hidl_string &portName,
     }
   }
 
-  pthread_mutex_lock(&mLock);
-  if (mCallback_1_0 != NULL) {
-    Return<void> ret =
-        mCallback_1_0->notifyRoleSwitchStatus(portName, newRole,
-        roleSwitch ? Status::SUCCESS : Status::ERROR);
-    if (!ret.isOk())
-      ALOGE("RoleSwitchStatus error %s", ret.description().c_str());
-  } else {
-    ALOGE("Not notifying the userspace. Callback is not set");
-  }
-  pthread_mutex_unlock(&mLock);
-  pthread_mutex_unlock(&mRoleSwitchLock);
+  pthread_mutex_unlock(roleSwitchLock);
+  notifyRoleSwitchStatus(this, portName, newRole, roleSwitch);
 
   return Void();
 }
 
-Status getAccessoryConnected(const std::string &portName, std::string *accessory) {
-  std::string filename =
-    "/sys/class/typec/" + portName + "-partner/accessory_mode";
-
-  if (readFile(filename, accessory)) {
-    ALOGE("getAccessoryConnected: Failed to open filesystem node: %s",
-          filename.c_str());
+Status getAccessoryConnected(struct PortAttrCache *attrs, const std::string &portName,
+                            char *accessory, size_t len) {
+  if (readPortAttr(attrs, portName, PORT_ATTR_PARTNER_ACCESSORY, accessory, len)) {
+    ALOGE("getAccessoryConnected: Failed to read %s-partner/accessory_mode",
+          portName.c_str());
     return Status::ERROR;
   }
 
   return Status::SUCCESS;
 }
 
-Status getCurrentRoleHelper(const std::string &portName, bool connected,
-                            PortRoleType type, uint32_t *currentRole) {
-  std::string filename;
-  std::string roleName;
-  std::string accessory;
+Status getCurrentRoleHelper(struct PortAttrCache *attrs, const std::string &portName,
+                            bool connected, PortRoleType type, uint32_t *currentRole) {
+  char buf[PORT_ATTR_BUF_LEN];
+  const char *roleName;
+  int attr;
 
   // Mode
 
   if (type == PortRoleType::POWER_ROLE) {
-    filename = "/sys/class/typec/" + portName + "/power_role";
+    attr = PORT_ATTR_POWER_ROLE;
     *currentRole = static_cast<uint32_t>(PortPowerRole::NONE);
   } else if (type == PortRoleType::DATA_ROLE) {
-    filename = "/sys/class/typec/" + portName + "/data_role";
+    attr = PORT_ATTR_DATA_ROLE;
     *currentRole = static_cast<uint32_t>(PortDataRole::NONE);
   } else if (type == PortRoleType::MODE) {
-    filename = "/sys/class/typec/" + portName + "/data_role";
+    attr = PORT_ATTR_DATA_ROLE;
     *currentRole = static_cast<uint32_t>(PortMode_1_1::NONE);
   } else {
     return Status::ERROR;
@@ -341,41 +658,41 @@ Status getCurrentRoleHelper(const std::string &portName, bool connected,
   if (!connected) return Status::SUCCESS;
 
   if (type == PortRoleType::MODE) {
-    if (getAccessoryConnected(portName, &accessory) != Status::SUCCESS) {
+    if (getAccessoryConnected(attrs, portName, buf, sizeof(buf)) != Status::SUCCESS) {
       return Status::ERROR;
     }
-    if (accessory == "analog_audio") {
+    if (!strcmp(buf, "analog_audio")) {
       *currentRole = static_cast<uint32_t>(PortMode_1_1::AUDIO_ACCESSORY);
       return Status::SUCCESS;
-    } else if (accessory == "debug") {
+    } else if (!strcmp(buf, "debug")) {
       *currentRole = static_cast<uint32_t>(PortMode_1_1::DEBUG_ACCESSORY);
       return Status::SUCCESS;
     }
   }
 
-  if (readFile(filename, &roleName)) {
-    ALOGE("getCurrentRole: Failed to open filesystem node: %s",
-          filename.c_str());
+  if (readPortAttr(attrs, portName, attr, buf, sizeof(buf))) {
+    ALOGE("getCurrentRole: Failed to read %s%s", portName.c_str(),
+          portAttrNodes[attr]);
     return Status::ERROR;
   }
 
-  extractRole(&roleName);
+  roleName = extractRole(buf);
 
-  if (roleName == "source") {
+  if (!strcmp(roleName, "source")) {
     *currentRole = static_cast<uint32_t>(PortPowerRole::SOURCE);
-  } else if (roleName == "sink") {
+  } else if (!strcmp(roleName, "sink")) {
     *currentRole = static_cast<uint32_t>(PortPowerRole::SINK);
-  } else if (roleName == "host") {
+  } else if (!strcmp(roleName, "host")) {
     if (type == PortRoleType::DATA_ROLE)
       *currentRole = static_cast<uint32_t>(PortDataRole::HOST);
     else
       *currentRole = static_cast<uint32_t>(PortMode_1_1::DFP);
-  } else if (roleName == "device") {
+  } else if (!strcmp(roleName, "device")) {
     if (type == PortRoleType::DATA_ROLE)
       *currentRole = static_cast<uint32_t>(PortDataRole::DEVICE);
     else
       *currentRole = static_cast<uint32_t>(PortMode_1_1::UFP);
-  } else if (roleName != "none") {
+  } else if (strcmp(roleName, "none")) {
     /* case for none has already been addressed.
      * so we check if the role isnt none.
      */
@@ -388,7 +705,7 @@ Status getCurrentRoleHelper(const std::string &portName, bool connected,
 Status getTypeCPortNamesHelper(std::unordered_map<std::string, bool> *names) {
   DIR *dp;
 
-  dp = opendir("/sys/class/typec");
+  dp = opendir(fsPath("/sys/class/typec").c_str());
   if (dp != NULL) {
     struct dirent *ep;
 
@@ -413,13 +730,13 @@ Status getTypeCPortNamesHelper(std::unordered_map<std::string, bool> *names) {
   return Status::ERROR;
 }
 
-bool canSwitchRoleHelper(const std::string &portName, PortRoleType /*type*/) {
-  std::string filename =
-      "/sys/class/typec/" + portName + "-partner/supports_usb_power_delivery";
-  std::string supportsPD;
+bool canSwitchRoleHelper(struct PortAttrCache *attrs, const std::string &portName,
+                         PortRoleType /*type*/) {
+  char supportsPD[PORT_ATTR_BUF_LEN];
 
-  if (!readFile(filename, &supportsPD)) {
-    if (supportsPD == "yes") {
+  if (!readPortAttr(attrs, portName, PORT_ATTR_PARTNER_PD, supportsPD,
+                    sizeof(supportsPD))) {
+    if (!strcmp(supportsPD, "yes")) {
       return true;
     }
   }
@@ -427,346 +744,1306 @@ bool canSwitchRoleHelper(const std::string &portName, PortRoleType /*type*/) {
   return false;
 }
 
+PortInfo::PortInfo()
+        : present(false),
+          connected(false),
+          contaminant(false),
+          result(Status::SUCCESS),
+          lock(PTHREAD_MUTEX_INITIALIZER),
+          roleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
+          modeSwitchPending(false),
+          modeSwitchStartUs(0),
+          modeSwitchDeadlineUs(0) {
+}
+
+PortInfo::~PortInfo() {
+  pthread_mutex_destroy(&lock);
+  pthread_mutex_destroy(&roleSwitchLock);
+}
+
 /*
- * The caller of this method would reconstruct the V1_0::PortStatus
- * object if required.
+ * Maps a typec device name ("port1", "port1-partner", "port1.0", ...)
+ * to its slot in Usb::mPorts. *suffix is left pointing past the port
+ * number. Returns -1 if the name does not start with a trackable port.
  */
-Status getPortStatusHelper(hidl_vec<PortStatus> *currentPortStatus_1_2,
-    bool V1_0, struct Usb *usb) {
-  std::unordered_map<std::string, bool> names;
-  Status result = getTypeCPortNamesHelper(&names);
-  int i = -1;
-
-  if (result == Status::SUCCESS) {
-    if (names.size() == 0) {
-      ALOGI("Hardcode parameters for non-typec targets");
-      currentPortStatus_1_2->resize(1);
-      /*
-       * Below assignments are done in accordance with the checks in VtsHalUsbV1_2TargetTest
-       * so as to make the VTS testing pass for non typec targets.
-       */
-      (*currentPortStatus_1_2)[0].status_1_1.status.supportedModes = V1_0::PortMode::NONE;
-      (*currentPortStatus_1_2)[0].status_1_1.status.currentMode = V1_0::PortMode::NONE;
-    } else {
-      currentPortStatus_1_2->resize(names.size());
-    }
-    for (std::pair<std::string, bool> port : names) {
-      i++;
-      ALOGI("%s", port.first.c_str());
-      (*currentPortStatus_1_2)[i].status_1_1.status.portName = port.first;
-
-      uint32_t currentRole;
-      if (getCurrentRoleHelper(port.first, port.second,
-                               PortRoleType::POWER_ROLE,
-                               &currentRole) == Status::SUCCESS) {
-        (*currentPortStatus_1_2)[i].status_1_1.status.currentPowerRole =
-            static_cast<PortPowerRole>(currentRole);
-      } else {
-        ALOGE("Error while retreiving portNames");
-        goto done;
-      }
+static int getPortIndex(const char *name, const char **suffix) {
+  char *end;
+  long idx;
 
-      if (getCurrentRoleHelper(port.first, port.second, PortRoleType::DATA_ROLE,
-                               &currentRole) == Status::SUCCESS) {
-        (*currentPortStatus_1_2)[i].status_1_1.status.currentDataRole =
-            static_cast<PortDataRole>(currentRole);
-      } else {
-        ALOGE("Error while retreiving current port role");
-        goto done;
-      }
+  if (strncmp(name, "port", 4) || !isdigit(name[4]))
+    return -1;
 
-      if (getCurrentRoleHelper(port.first, port.second, PortRoleType::MODE,
-                               &currentRole) == Status::SUCCESS) {
-        (*currentPortStatus_1_2)[i].status_1_1.currentMode =
-            static_cast<PortMode_1_1>(currentRole);
-        (*currentPortStatus_1_2)[i].status_1_1.status.currentMode =
-            static_cast<V1_0::PortMode>(currentRole);
-      } else {
-        ALOGE("Error while retreiving current data role");
-        goto done;
-      }
+  idx = strtol(name + 4, &end, 10);
+  if (idx >= MAX_TYPEC_PORTS)
+    return -1;
 
-      (*currentPortStatus_1_2)[i].status_1_1.status.canChangeMode = true;
-      (*currentPortStatus_1_2)[i].status_1_1.status.canChangeDataRole =
-          port.second ? canSwitchRoleHelper(port.first, PortRoleType::DATA_ROLE)
-                      : false;
-      (*currentPortStatus_1_2)[i].status_1_1.status.canChangePowerRole =
-          port.second
-              ? canSwitchRoleHelper(port.first, PortRoleType::POWER_ROLE)
-              : false;
-
-      ALOGI("connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d",
-            port.second, (*currentPortStatus_1_2)[i].status_1_1.status.canChangeMode,
-            (*currentPortStatus_1_2)[i].status_1_1.status.canChangeDataRole,
-            (*currentPortStatus_1_2)[i].status_1_1.status.canChangePowerRole);
-
-      if (V1_0) {
-        (*currentPortStatus_1_2)[i].status_1_1.status.supportedModes = V1_0::PortMode::DFP;
-      } else {
-        (*currentPortStatus_1_2)[i].status_1_1.supportedModes =
-	    PortMode_1_1::DRP | PortMode_1_1::AUDIO_ACCESSORY;
-        (*currentPortStatus_1_2)[i].status_1_1.status.supportedModes = V1_0::PortMode::NONE;
-        (*currentPortStatus_1_2)[i].status_1_1.status.currentMode = V1_0::PortMode::NONE;
-
-        (*currentPortStatus_1_2)[i].supportedContaminantProtectionModes =
-            ContaminantProtectionMode::FORCE_SINK | ContaminantProtectionMode::FORCE_DISABLE;
-        (*currentPortStatus_1_2)[i].supportsEnableContaminantPresenceProtection =
-            false;
-        (*currentPortStatus_1_2)[i].supportsEnableContaminantPresenceDetection =
-            false;
-        (*currentPortStatus_1_2)[i].contaminantProtectionStatus =
-            ContaminantProtectionStatus::FORCE_SINK;
-
-        if (port.first != "port0") // moisture detection only on first port
-          continue;
-
-        std::string contaminantPresence;
-
-        if (!usb->mContaminantStatusPath.empty() &&
-                                !readFile(usb->mContaminantStatusPath, &contaminantPresence)) {
-          if (contaminantPresence == "1") {
-            (*currentPortStatus_1_2)[i].contaminantDetectionStatus =
-                ContaminantDetectionStatus::DETECTED;
-            ALOGI("moisture: Contaminant presence detected");
-          }
-          else {
-            (*currentPortStatus_1_2)[i].contaminantDetectionStatus =
-                ContaminantDetectionStatus::NOT_DETECTED;
-          }
-        } else {
-          (*currentPortStatus_1_2)[i].supportedContaminantProtectionModes =
-              ContaminantProtectionMode::NONE | ContaminantProtectionMode::NONE;
-          (*currentPortStatus_1_2)[i].contaminantProtectionStatus =
-              ContaminantProtectionStatus::NONE;
-        }
-      }
-    }
-    return Status::SUCCESS;
-  }
-done:
-  return Status::ERROR;
+  *suffix = end;
+  return idx;
 }
 
-Return<void> Usb::queryPortStatus() {
-  hidl_vec<PortStatus> currentPortStatus_1_2;
-  hidl_vec<V1_1::PortStatus_1_1> currentPortStatus_1_1;
-  hidl_vec<V1_0::PortStatus> currentPortStatus;
-  Status status;
-  sp<IUsbCallback> callback_V1_2 = IUsbCallback::castFrom(mCallback_1_0);
-  sp<V1_1::IUsbCallback> callback_V1_1 = V1_1::IUsbCallback::castFrom(mCallback_1_0);
-
-  pthread_mutex_lock(&mLock);
-  if (mCallback_1_0 != NULL) {
-    if (callback_V1_1 != NULL) { // 1.1 or 1.2
-      if (callback_V1_2 == NULL) { // 1.1 only
-        status = getPortStatusHelper(&currentPortStatus_1_2, false, this);
-        currentPortStatus_1_1.resize(currentPortStatus_1_2.size());
-        for (unsigned long i = 0; i < currentPortStatus_1_2.size(); i++)
-          currentPortStatus_1_1[i].status = currentPortStatus_1_2[i].status_1_1.status;
-      }
-      else  //1.2 only
-        status = getPortStatusHelper(&currentPortStatus_1_2, false, this);
-    } else { // 1.0 only
-      status = getPortStatusHelper(&currentPortStatus_1_2, true, this);
-      currentPortStatus.resize(currentPortStatus_1_2.size());
-      for (unsigned long i = 0; i < currentPortStatus_1_2.size(); i++)
-        currentPortStatus[i] = currentPortStatus_1_2[i].status_1_1.status;
-    }
-
-    Return<void> ret;
-
-    if (callback_V1_2 != NULL)
-      ret = callback_V1_2->notifyPortStatusChange_1_2(currentPortStatus_1_2, status);
-    else if (callback_V1_1 != NULL)
-      ret = callback_V1_1->notifyPortStatusChange_1_1(currentPortStatus_1_1, status);
-    else
-      ret = mCallback_1_0->notifyPortStatusChange(currentPortStatus, status);
+// Slot of a port name in Usb::mPorts, -1 if it is not a trackable port.
+static int getPortNameIndex(const std::string &portName) {
+  const char *suffix;
+  int idx = getPortIndex(portName.c_str(), &suffix);
 
-    if (!ret.isOk())
-      ALOGE("queryPortStatus_1_1 error %s", ret.description().c_str());
-  } else {
-    ALOGI("Notifying userspace skipped. Callback is NULL");
-  }
-  pthread_mutex_unlock(&mLock);
-  return Void();
+  return idx < 0 || *suffix != '\0' ? -1 : idx;
 }
 
-struct data {
-  int uevent_fd;
-  android::hardware::usb::V1_2::implementation::Usb *usb;
-};
-
-Return<void> callbackNotifyPortStatusChangeHelper(struct Usb *usb) {
-  hidl_vec<PortStatus> currentPortStatus_1_2;
-  Status status;
-  Return<void> ret;
-  sp<IUsbCallback> callback_V1_2 = IUsbCallback::castFrom(usb->mCallback_1_0);
+// Role switches on different ports do not wait for each other.
+static pthread_mutex_t *getRoleSwitchLock(struct Usb *usb, const std::string &portName) {
+  int idx = getPortNameIndex(portName);
 
-  pthread_mutex_lock(&usb->mLock);
-  status = getPortStatusHelper(&currentPortStatus_1_2, false, usb);
-  ret = callback_V1_2->notifyPortStatusChange_1_2(currentPortStatus_1_2, status);
+  if (idx < 0)
+    return &usb->mRoleSwitchLock;
 
-  if (!ret.isOk())
-    ALOGE("notifyPortStatusChange_1_2 error %s", ret.description().c_str());
+  return &usb->mPorts[idx].roleSwitchLock;
+}
 
-  pthread_mutex_unlock(&usb->mLock);
-  return Void();
+static void closePortAttrs(struct PortAttrCache *attrs) {
+  for (int i = 0; i < PORT_ATTR_COUNT; i++) {
+    if (attrs->fds[i] >= 0) close(attrs->fds[i]);
+    attrs->fds[i] = -1;
+  }
 }
 
-Return<void> Usb::enableContaminantPresenceDetection(const hidl_string &portName,
-                                                     bool enable) {
-  Return<void> ret;
+// Caller must hold usb->mPortLock for writing.
+static void setPortPresentLocked(struct Usb *usb, int idx, const std::string &name) {
+  struct PortInfo *port = &usb->mPorts[idx];
 
-  ret = callbackNotifyPortStatusChangeHelper(this);
-  ALOGI("Contaminant Presence Detection should always be in enable mode");
+  if (port->present && port->name == name)
+    return;
 
-  return Void();
+  closePortAttrs(&port->attrs);
+  port->name = name;
+  port->powerOpMode.clear();
+  port->present = true;
+  port->connected = false;
+  for (int i = 0; i < PORT_ATTR_PARTNER_FIRST; i++)
+    openPortAttr(&port->attrs, name, i);
 }
 
-Return<void> Usb::enableContaminantPresenceProtection(const hidl_string &portName,
-                                                      bool enable) {
-  Return<void> ret;
-
-  ret = callbackNotifyPortStatusChangeHelper(this);
-  ALOGI("Contaminant Presence Protection should always be in enable mode");
+// Caller must hold usb->mPortLock for writing.
+static void clearPortLocked(struct Usb *usb, int idx) {
+  struct PortInfo *port = &usb->mPorts[idx];
 
-  return Void();
+  closePortAttrs(&port->attrs);
+  port->name.clear();
+  port->powerOpMode.clear();
+  port->present = false;
+  port->connected = false;
 }
 
-static void handle_typec_uevent(Usb *usb, const char *msg)
-{
-  ALOGI("uevent received %s", msg);
-
-  // if (std::regex_match(cp, std::regex("(add)(.*)(-partner)")))
-  if (!strncmp(msg, "add@", 4) && !strncmp(msg + strlen(msg) - 8, "-partner", 8)) {
-     ALOGI("partner added");
-     pthread_mutex_lock(&usb->mPartnerLock);
-     usb->mPartnerUp = true;
-     pthread_cond_signal(&usb->mPartnerCV);
-     pthread_mutex_unlock(&usb->mPartnerLock);
+/*
+ * Re-reads the sysfs state of a single port into its PortInfo.
+ * The status is always filled in the V1_1/V1_2 layout; publishPortStatus
+ * snapshots it and fillPortStatus derives the V1_0 fields from the snapshot
+ * for older callbacks.
+ * Caller must hold usb->mPortLock for writing, or for reading along with
+ * the lock of the port.
+ */
+static Status refreshPortLocked(struct Usb *usb, int idx) {
+  struct PortInfo *port = &usb->mPorts[idx];
+  PortStatus *status = &port->status;
+  uint32_t currentRole;
+
+  *status = PortStatus();
+  ALOGI("%s", port->name.c_str());
+  status->status_1_1.status.portName = port->name;
+
+  if (getCurrentRoleHelper(&port->attrs, port->name, port->connected,
+                           PortRoleType::POWER_ROLE,
+                           &currentRole) == Status::SUCCESS) {
+    status->status_1_1.status.currentPowerRole =
+        static_cast<PortPowerRole>(currentRole);
+  } else {
+    ALOGE("Error while retreiving portNames");
+    goto done;
   }
 
-  std::string power_operation_mode;
-  if (!readFile("/sys/class/typec/port0/power_operation_mode", &power_operation_mode)) {
-    if (usb->mPowerOpMode == power_operation_mode) {
-      ALOGI("uevent recieved for same device %s", power_operation_mode.c_str());
-    } else if(power_operation_mode == "usb_power_delivery") {
-      readFile("/config/usb_gadget/g1/configs/b.1/MaxPower", &usb->mMaxPower);
-      readFile("/config/usb_gadget/g1/configs/b.1/bmAttributes", &usb->mAttributes);
-      writeFile("/config/usb_gadget/g1/configs/b.1/MaxPower", "0");
-      writeFile("/config/usb_gadget/g1/configs/b.1/bmAttributes", "0xc0");
-    } else {
-      if(!usb->mMaxPower.empty()) {
-        writeFile("/config/usb_gadget/g1/configs/b.1/MaxPower", usb->mMaxPower.c_str());
-        writeFile("/config/usb_gadget/g1/configs/b.1/bmAttributes", usb->mAttributes.c_str());
-        usb->mMaxPower = "";
-      }
-    }
-
-    usb->mPowerOpMode = power_operation_mode;
+  if (getCurrentRoleHelper(&port->attrs, port->name, port->connected,
+                           PortRoleType::DATA_ROLE,
+                           &currentRole) == Status::SUCCESS) {
+    status->status_1_1.status.currentDataRole =
+        static_cast<PortDataRole>(currentRole);
+  } else {
+    ALOGE("Error while retreiving current port role");
+    goto done;
   }
 
-  usb->queryPortStatus();
-}
-
-// process POWER_SUPPLY uevent for contaminant presence
-static void handle_psy_uevent(Usb *usb, const char *msg)
-{
-  sp<IUsbCallback> callback_V1_2 = IUsbCallback::castFrom(usb->mCallback_1_0);
-  hidl_vec<PortStatus> currentPortStatus_1_2;
-  Status status;
-  Return<void> ret;
-  bool moisture_detected;
-  std::string contaminantPresence;
+  if (getCurrentRoleHelper(&port->attrs, port->name, port->connected,
+                           PortRoleType::MODE,
+                           &currentRole) == Status::SUCCESS) {
+    status->status_1_1.currentMode = static_cast<PortMode_1_1>(currentRole);
+  } else {
+    ALOGE("Error while retreiving current data role");
+    goto done;
+  }
 
-  // don't bother parsing any further if caller doesn't support USB HAL 1.2
-  // to report contaminant presence events
-  if (callback_V1_2 == NULL)
-    return;
+  status->status_1_1.status.canChangeMode = true;
+  status->status_1_1.status.canChangeDataRole =
+      port->connected ? canSwitchRoleHelper(&port->attrs, port->name,
+                                            PortRoleType::DATA_ROLE)
+                      : false;
+  status->status_1_1.status.canChangePowerRole =
+      port->connected ? canSwitchRoleHelper(&port->attrs, port->name,
+                                            PortRoleType::POWER_ROLE)
+                      : false;
 
-  while (*msg) {
-    if (!strncmp(msg, "POWER_SUPPLY_NAME=", 18)) {
-      msg += 18;
-      if (strcmp(msg, "usb")) // make sure we're looking at the correct uevent
-        return;
-      else
-        break;
+  ALOGI("connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d",
+        port->connected, status->status_1_1.status.canChangeMode,
+        status->status_1_1.status.canChangeDataRole,
+        status->status_1_1.status.canChangePowerRole);
+
+  status->status_1_1.supportedModes =
+      PortMode_1_1::DRP | PortMode_1_1::AUDIO_ACCESSORY;
+  status->status_1_1.status.supportedModes = V1_0::PortMode::NONE;
+  status->status_1_1.status.currentMode = V1_0::PortMode::NONE;
+
+  status->supportedContaminantProtectionModes =
+      ContaminantProtectionMode::FORCE_SINK | ContaminantProtectionMode::FORCE_DISABLE;
+  status->supportsEnableContaminantPresenceProtection = false;
+  status->supportsEnableContaminantPresenceDetection = false;
+  status->contaminantProtectionStatus = ContaminantProtectionStatus::FORCE_SINK;
+
+  // Kept up to date by the worker, see checkContaminant().
+  if (!port->contaminantPath.empty()) {
+    if (port->contaminant) {
+      status->contaminantDetectionStatus = ContaminantDetectionStatus::DETECTED;
+      ALOGI("moisture: Contaminant presence detected on %s", port->name.c_str());
+    } else {
+      status->contaminantDetectionStatus = ContaminantDetectionStatus::NOT_DETECTED;
     }
-
-    // advance to after the next \0
-    while (*msg++) ;
+  } else {
+    status->supportedContaminantProtectionModes =
+        ContaminantProtectionMode::NONE | ContaminantProtectionMode::NONE;
+    status->contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
   }
 
-  // read moisture detection status from sysfs
-  if (usb->mContaminantStatusPath.empty() ||
-        readFile(usb->mContaminantStatusPath, &contaminantPresence))
-    return;
-
-  moisture_detected = (contaminantPresence[0] == '1');
+  port->result = Status::SUCCESS;
+  return Status::SUCCESS;
 
-  if (usb->mContaminantPresence != moisture_detected) {
-    usb->mContaminantPresence = moisture_detected;
+done:
+  port->result = Status::ERROR;
+  return Status::ERROR;
+}
 
-    status = getPortStatusHelper(&currentPortStatus_1_2, false, usb);
-    ret = callback_V1_2->notifyPortStatusChange_1_2(currentPortStatus_1_2, status);
-    if (!ret.isOk()) ALOGE("error %s", ret.description().c_str());
+/*
+ * Enumerates /sys/class/typec and brings mPorts in line with it. Only used
+ * at setCallback() time and for uevents that cannot be attributed to a
+ * known port; everything else updates mPorts incrementally.
+ * Caller must hold usb->mPortLock for writing.
+ */
+static Status rescanPortsLocked(struct Usb *usb) {
+  std::unordered_map<std::string, bool> names;
+  bool present[MAX_TYPEC_PORTS] = {};
+
+  usb->mPortsScanned = true;
+  usb->mScanStatus = getTypeCPortNamesHelper(&names);
+  if (usb->mScanStatus != Status::SUCCESS)
+    return usb->mScanStatus;
+
+  for (std::pair<std::string, bool> port : names) {
+    const char *suffix;
+    int idx = getPortIndex(port.first.c_str(), &suffix);
+
+    // Skip cables, plugs and anything else that is not a port.
+    if (idx < 0 || *suffix != '\0')
+      continue;
+
+    present[idx] = true;
+    setPortPresentLocked(usb, idx, port.first);
+    if (usb->mPorts[idx].connected != port.second) {
+      usb->mPorts[idx].connected = port.second;
+      closePartnerAttrs(&usb->mPorts[idx].attrs);
+    }
   }
 
-  //Role switch is not in progress and port is in disconnected state
-  if (!pthread_mutex_trylock(&usb->mRoleSwitchLock)) {
-    for (unsigned long i = 0; i < currentPortStatus_1_2.size(); i++) {
-      DIR *dp = opendir(std::string("/sys/class/typec/"
-          + std::string(currentPortStatus_1_2[i].status_1_1.status.portName.c_str())
-          + "-partner").c_str());
-      if (dp == NULL) {
-        //PortRole role = {.role = static_cast<uint32_t>(PortMode::UFP)};
-        switchToDrp(currentPortStatus_1_2[i].status_1_1.status.portName);
-      } else {
-        closedir(dp);
-      }
-    }
-    pthread_mutex_unlock(&usb->mRoleSwitchLock);
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    if (!present[i] && usb->mPorts[i].present)
+      clearPortLocked(usb, i);
+    else if (present[i])
+      refreshPortLocked(usb, i);
   }
+
+  return Status::SUCCESS;
 }
 
-static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
-  char msg[UEVENT_MSG_LEN + 2];
-  int n;
-  static std::regex add_regex("add@(/devices/platform/soc/.*dwc3/xhci-hcd\\.\\d\\.auto/"
-                              "usb\\d/\\d-\\d(?:/[\\d\\.-]+)*)");
-  static std::regex bind_regex("bind@(/devices/platform/soc/.*dwc3/xhci-hcd\\.\\d\\.auto/"
-                               "usb\\d/\\d-\\d(?:/[\\d\\.-]+)*)/([^/]*:[^/]*)");
-
-  n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN);
-  if (n <= 0) return;
-  if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
+/*
+ * Takes usb->mPortLock for reading, enumerating /sys/class/typec first if
+ * that has not happened yet.
+ */
+static void lockPortsShared(struct Usb *usb) {
+  pthread_rwlock_rdlock(&usb->mPortLock);
+  if (usb->mPortsScanned)
     return;
 
-  msg[n] = '\0';
-  msg[n + 1] = '\0';
+  pthread_rwlock_unlock(&usb->mPortLock);
+  pthread_rwlock_wrlock(&usb->mPortLock);
+  if (!usb->mPortsScanned)
+    rescanPortsLocked(usb);
+  pthread_rwlock_unlock(&usb->mPortLock);
+  pthread_rwlock_rdlock(&usb->mPortLock);
+}
 
-  std::cmatch match;
+// The V1_0 part of each PortStatus version.
+static V1_0::PortStatus *basePortStatus(V1_0::PortStatus *status) { return status; }
+static V1_0::PortStatus *basePortStatus(PortStatus_1_1 *status) { return &status->status; }
+static V1_0::PortStatus *basePortStatus(PortStatus *status) { return &status->status_1_1.status; }
+
+/*
+ * Fills in the status of a port in the layout of a callback version straight
+ * from the cached V1_2 status. Caller must hold the lock of the port.
+ */
+static void fillPortStatus(const struct PortInfo *port, V1_0::PortStatus *status) {
+  *status = port->status.status_1_1.status;
+  status->currentMode = static_cast<V1_0::PortMode>(port->status.status_1_1.currentMode);
+  status->supportedModes = V1_0::PortMode::DFP;
+}
+
+static void fillPortStatus(const struct PortInfo *port, PortStatus_1_1 *status) {
+  status->status = port->status.status_1_1.status;
+}
+
+static void fillPortStatus(const struct PortInfo *port, PortStatus *status) {
+  *status = port->status;
+}
+
+/*
+ * Builds the status of all the known ports from mPorts without touching
+ * sysfs, in the layout of the PortStatus version T.
+ */
+template <typename T>
+static Status getPortStatusHelper(hidl_vec<T> *currentPortStatus, struct Usb *usb) {
+  ScopedLatency latency(&usb->mPortStatusLatency);
+  Status result;
+  size_t count = 0;
+
+  lockPortsShared(usb);
+  result = usb->mScanStatus;
+  if (result != Status::SUCCESS)
+    goto done;
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    if (usb->mPorts[i].present) count++;
+
+  if (count == 0) {
+    ALOGI("Hardcode parameters for non-typec targets");
+    currentPortStatus->resize(1);
+    /*
+     * Below assignments are done in accordance with the checks in VtsHalUsbV1_2TargetTest
+     * so as to make the VTS testing pass for non typec targets.
+     */
+    basePortStatus(&(*currentPortStatus)[0])->supportedModes = V1_0::PortMode::NONE;
+    basePortStatus(&(*currentPortStatus)[0])->currentMode = V1_0::PortMode::NONE;
+    goto done;
+  }
+
+  currentPortStatus->resize(count);
+  for (int i = 0, j = 0; i < MAX_TYPEC_PORTS; i++) {
+    struct PortInfo *port = &usb->mPorts[i];
+
+    if (!port->present)
+      continue;
+
+    pthread_mutex_lock(&port->lock);
+    fillPortStatus(port, &(*currentPortStatus)[j]);
+    if (port->result != Status::SUCCESS)
+      result = Status::ERROR;
+    pthread_mutex_unlock(&port->lock);
+    j++;
+  }
+
+done:
+  pthread_rwlock_unlock(&usb->mPortLock);
+  return result;
+}
+
+/*
+ * Publishes the current contents of the port table, in the layout of the
+ * registered callback, as the snapshot served to readers and returns it.
+ */
+static std::shared_ptr<const PortStatusSnapshot> publishPortStatus(struct Usb *usb) {
+  std::shared_ptr<PortStatusSnapshot> snapshot = std::make_shared<PortStatusSnapshot>();
+
+  pthread_mutex_lock(&usb->mLock);
+  snapshot->version = usb->mCallbackVersion;
+  pthread_mutex_unlock(&usb->mLock);
+
+  pthread_mutex_lock(&usb->mSnapshotLock);
+  switch (snapshot->version) {
+    case CALLBACK_V1_0:
+      snapshot->status = getPortStatusHelper(&snapshot->ports_1_0, usb);
+      break;
+    case CALLBACK_V1_1:
+      snapshot->status = getPortStatusHelper(&snapshot->ports_1_1, usb);
+      break;
+    default:
+      snapshot->status = getPortStatusHelper(&snapshot->ports_1_2, usb);
+      break;
+  }
+  snapshot->generation = ++usb->mSnapshotGeneration;
+  clock_gettime(CLOCK_MONOTONIC, &snapshot->timestamp);
+  std::atomic_store(&usb->mSnapshot, std::shared_ptr<const PortStatusSnapshot>(snapshot));
+  pthread_mutex_unlock(&usb->mSnapshotLock);
+
+  return snapshot;
+}
+
+// Returns the latest snapshot, publishing the first one if required.
+static std::shared_ptr<const PortStatusSnapshot> getPortStatusSnapshot(struct Usb *usb) {
+  std::shared_ptr<const PortStatusSnapshot> snapshot = std::atomic_load(&usb->mSnapshot);
+
+  return snapshot != NULL ? snapshot : publishPortStatus(usb);
+}
+
+// Reports a port status snapshot to the registered callback.
+static void notifyPortStatus(struct Usb *usb,
+                             std::shared_ptr<const PortStatusSnapshot> snapshot) {
+  Return<void> ret;
+
+  pthread_mutex_lock(&usb->mLock);
+  CallbackVersion version = usb->mCallbackVersion;
+  sp<V1_0::IUsbCallback> callback_V1_0 = usb->mCallback_1_0;
+  sp<V1_1::IUsbCallback> callback_V1_1 = usb->mCallback_1_1;
+  sp<IUsbCallback> callback_V1_2 = usb->mCallback_1_2;
+  pthread_mutex_unlock(&usb->mLock);
+
+  if (version == CALLBACK_NONE) {
+    ALOGI("Notifying userspace skipped. Callback is NULL");
+    return;
+  }
+
+  // The callback has been replaced by one of another version since.
+  if (snapshot->version != version)
+    snapshot = publishPortStatus(usb);
+  if (snapshot->version != version) {
+    ALOGI("Notifying userspace skipped. Callback changed");
+    return;
+  }
+
+  switch (version) {
+    case CALLBACK_V1_2:
+      ret = callback_V1_2->notifyPortStatusChange_1_2(snapshot->ports_1_2, snapshot->status);
+      break;
+    case CALLBACK_V1_1:
+      ret = callback_V1_1->notifyPortStatusChange_1_1(snapshot->ports_1_1, snapshot->status);
+      break;
+    default:
+      ret = callback_V1_0->notifyPortStatusChange(snapshot->ports_1_0, snapshot->status);
+      break;
+  }
+
+  if (!ret.isOk())
+    ALOGE("queryPortStatus_1_1 error %s", ret.description().c_str());
+}
+
+Return<void> Usb::queryPortStatus() {
+  // The worker thread keeps the snapshot up to date from uevents.
+  notifyPortStatus(this, getPortStatusSnapshot(this));
+  return Void();
+}
+
+struct data {
+  int uevent_fd;
+  // Fires once a burst of typec uevents has been quiet for debounce_ms.
+  int timer_fd;
+  int debounce_ms;
+  bool flush_armed;
+  // When the currently armed flush was first requested.
+  struct timespec dirty_since;
+  // PortInfo::contaminantPath of each port number, -1 if there is none
+  int contaminant_fds[MAX_TYPEC_PORTS];
+  // Bitmask of contaminant_fds that are notified by their driver and need
+  // no power_supply uevents to notice moisture changes
+  uint32_t contaminant_notified;
+  // UEVENT_RECORD_PROP, -1 unless recording
+  int record_fd;
+  android::hardware::usb::V1_2::implementation::Usb *usb;
+};
+
+Return<void> callbackNotifyPortStatusChangeHelper(struct Usb *usb) {
+  pthread_mutex_lock(&usb->mLock);
+  bool callback_V1_2 = usb->mCallbackVersion == CALLBACK_V1_2;
+  pthread_mutex_unlock(&usb->mLock);
+
+  if (callback_V1_2)
+    notifyPortStatus(usb, getPortStatusSnapshot(usb));
+
+  return Void();
+}
+
+Return<void> Usb::enableContaminantPresenceDetection(const hidl_string &portName,
+                                                     bool enable) {
+  Return<void> ret;
+
+  ret = callbackNotifyPortStatusChangeHelper(this);
+  ALOGI("Contaminant Presence Detection should always be in enable mode");
+
+  return Void();
+}
+
+Return<void> Usb::enableContaminantPresenceProtection(const hidl_string &portName,
+                                                      bool enable) {
+  Return<void> ret;
+
+  ret = callbackNotifyPortStatusChangeHelper(this);
+  ALOGI("Contaminant Presence Protection should always be in enable mode");
+
+  return Void();
+}
+
+// Argument of replayThread()
+struct ReplayRequest {
+  sp<Usb> usb;
+  std::shared_ptr<struct UeventReplay> replay;
+};
+
+/*
+ * Runs a replay started by replayUeventLog() off the worker, so that live
+ * uevents and the worker's timers are served meanwhile. Holds on to the
+ * live instance and the replay as debug() may stop waiting for it.
+ */
+static void *replayThread(void *param) {
+  struct ReplayRequest *request = (struct ReplayRequest *)param;
+  struct Usb *usb = request->usb.get();
+  struct UeventReplay *replay = request->replay.get();
+
+  replayUeventsDryRun(usb, replay, android::base::GetIntProperty(UEVENT_DEBOUNCE_PROP,
+                                                                 UEVENT_DEBOUNCE_MS));
+  ALOGI("replayed %" PRIu64 " uevents of %s in %" PRIu64 "us, %" PRIu64 " handled, result %d",
+        replay->events, replay->path.c_str(), replay->elapsedUs, replay->handled,
+        replay->result);
+
+  pthread_mutex_lock(&usb->mReplayLock);
+  replay->done = true;
+  usb->mReplay = NULL;
+  pthread_cond_broadcast(&usb->mReplayCV);
+  pthread_mutex_unlock(&usb->mReplayLock);
+
+  delete request;
+  return NULL;
+}
+
+/*
+ * Replays the uevent log given by options[1] on a thread of its own, see
+ * replayUevents(), and reports how that went on fd. Gives up waiting after
+ * UEVENT_REPLAY_TIMEOUT seconds, the results are logged either way.
+ */
+static void replayUeventLog(struct Usb *usb, int fd, const hidl_vec<hidl_string> &options) {
+  std::shared_ptr<struct UeventReplay> replay = std::make_shared<struct UeventReplay>();
+  struct ReplayRequest *request;
+  struct timespec to;
+  pthread_t thread;
+  bool done;
+  int err;
+
+  replay->path = options[1];
+  if (options.size() > 2 && !android::base::ParseUint(options[2].c_str(), &replay->speedup)) {
+    dprintf(fd, "invalid speedup %s\n", options[2].c_str());
+    return;
+  }
+
+  pthread_mutex_lock(&usb->mReplayLock);
+  if (usb->mReplay != NULL) {
+    dprintf(fd, "replay: already in progress\n");
+    pthread_mutex_unlock(&usb->mReplayLock);
+    return;
+  }
+  request = new ReplayRequest{usb, replay};
+  err = pthread_create(&thread, NULL, replayThread, request);
+  if (err) {
+    dprintf(fd, "replay: pthread_create failed: %s\n", strerror(err));
+    pthread_mutex_unlock(&usb->mReplayLock);
+    delete request;
+    return;
+  }
+  pthread_detach(thread);
+  usb->mReplay = replay;
+
+  clock_gettime(CLOCK_MONOTONIC, &to);
+  to.tv_sec += UEVENT_REPLAY_TIMEOUT;
+  while (!replay->done && err != ETIMEDOUT)
+    err = pthread_cond_timedwait(&usb->mReplayCV, &usb->mReplayLock, &to);
+  done = replay->done;
+  pthread_mutex_unlock(&usb->mReplayLock);
+
+  if (!done) {
+    dprintf(fd, "replay of %s still running after %ds, see logcat for the results\n",
+            replay->path.c_str(), UEVENT_REPLAY_TIMEOUT);
+    return;
+  }
+
+  if (replay->result)
+    dprintf(fd, "replay of %s failed: %s\n", replay->path.c_str(), strerror(replay->result));
+  dprintf(fd, "replayed %" PRIu64 " uevents in %" PRIu64 "us", replay->events,
+          replay->elapsedUs);
+  if (replay->elapsedUs)
+    dprintf(fd, ", %" PRIu64 " uevents/s", replay->events * 1000000 / replay->elapsedUs);
+  dprintf(fd, ", %" PRIu64 " handled\n", replay->handled);
+  replay->latency.dump(fd);
+}
+
+/*
+ * Attaches or detaches the uevent socket filter on the fly. With the filter
+ * detached the worker counts the uevents it would have dropped, which is
+ * what it saves the worker while attached.
+ */
+static void setUeventFilter(struct Usb *usb, int fd, const hidl_string &state) {
+  bool attach = state == "on";
+
+  if (!attach && state != "off") {
+    dprintf(fd, "invalid filter state %s\n", state.c_str());
+    return;
+  }
+
+  pthread_mutex_lock(&usb->mReplayLock);
+  if (usb->mUeventFd < 0) {
+    dprintf(fd, "filter: worker not running\n");
+  } else if (attach) {
+    usb->mUeventFilterAttached = !attachUeventFilter(usb->mUeventFd);
+  } else if (setsockopt(usb->mUeventFd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) &&
+             errno != ENOENT) {
+    dprintf(fd, "failed to detach uevent filter: %s\n", strerror(errno));
+  } else {
+    usb->mUeventFilterAttached = false;
+  }
+  pthread_mutex_unlock(&usb->mReplayLock);
+
+  dprintf(fd, "uevent filter: %s\n", usb->mUeventFilterAttached ? "attached" : "off");
+}
+
+Return<void> Usb::debug(const hidl_handle &handle, const hidl_vec<hidl_string> &options) {
+  if (handle == nullptr || handle->numFds < 1) {
+    ALOGE("debug: invalid handle");
+    return Void();
+  }
+
+  int fd = handle->data[0];
+
+  if (options.size() > 0) {
+    if (options.size() >= 2 && options.size() <= 3 && options[0] == "replay")
+      replayUeventLog(this, fd, options);
+    else if (options.size() == 2 && options[0] == "filter")
+      setUeventFilter(this, fd, options[1]);
+    else
+      dprintf(fd, "usage: replay <uevent log> [speedup]\n"
+                  "       filter <on|off>\n");
+    return Void();
+  }
+
+  dprintf(fd, "uevent filter: %s\n", mUeventFilterAttached ? "attached" : "off");
+  dprintf(fd, "uevents delivered: %" PRIu64 "\n", mUeventsDelivered.load());
+  dprintf(fd, "uevents handled: %" PRIu64 "\n", mUeventsHandled.load());
+  dprintf(fd, "uevents delivered that the filter drops: %" PRIu64 "\n",
+          mUeventsFilterable.load());
+
+  std::shared_ptr<const PortStatusSnapshot> snapshot = std::atomic_load(&mSnapshot);
+  if (snapshot != NULL) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dprintf(fd, "port status generation: %" PRIu64 ", %lds old\n", snapshot->generation,
+            (long)(now.tv_sec - snapshot->timestamp.tv_sec));
+  } else {
+    dprintf(fd, "port status: not published\n");
+  }
+
+  pthread_mutex_lock(&mPartnerLock);
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    if (mPorts[i].modeSwitchPending)
+      dprintf(fd, "role switch pending: %s %s\n", mPorts[i].modeSwitchPort.c_str(),
+              convertRoletoString(mPorts[i].modeSwitchRole).c_str());
+  pthread_mutex_unlock(&mPartnerLock);
+  dprintf(fd, "port type switch timeouts: %" PRIu64 "\n", mModeSwitchTimeouts.load());
+
+  mSwitchRoleLatency.dump(fd);
+  mSwitchModeLatency.dump(fd);
+  mUeventLatency.dump(fd);
+  mPortStatusLatency.dump(fd);
+
+  return Void();
+}
+
+/*
+ * Applies a typec uevent to the port table and marks the port the DEVPATH
+ * belongs to for re-reading once the uevent burst settles. Falls back to a
+ * full rescan of /sys/class/typec when the uevent cannot be attributed to
+ * a known port.
+ */
+static void updatePortFromUevent(struct Usb *usb, const char *msg) {
+  bool add = !strncmp(msg, "add@", 4);
+  bool remove = !strncmp(msg, "remove@", 7);
+  const char *name = strstr(msg, "typec/");
+  const char *suffix;
+  int idx = name ? getPortIndex(name + 6, &suffix) : -1;
+  struct PortInfo *port;
+
+  pthread_rwlock_wrlock(&usb->mPortLock);
+  if (idx < 0 || !usb->mPortsScanned) {
+    usb->mRescanPending = true;
+    goto out;
+  }
+
+  port = &usb->mPorts[idx];
+  name += 6;
+  if (*suffix == '\0') {
+    // The port device itself.
+    if (remove)
+      clearPortLocked(usb, idx);
+    else
+      setPortPresentLocked(usb, idx, std::string(name, suffix - name));
+  } else if (!port->present) {
+    usb->mRescanPending = true;
+    goto out;
+  } else if (suffix[0] == '/' && !strncmp(suffix + 1, name, suffix - name) &&
+             !strcmp(suffix + 1 + (suffix - name), "-partner") && (add || remove)) {
+    // The partner is a child of the port, .../typec/port<N>/port<N>-partner.
+    // Partner nodes come and go with the partner; refresh the held fds
+    // here so that status queries never have to reopen them.
+    port->connected = add;
+    closePartnerAttrs(&port->attrs);
+    if (add)
+      openPartnerAttrs(&port->attrs, port->name);
+  }
+
+  usb->mDirtyPorts |= 1U << idx;
+
+out:
+  pthread_rwlock_unlock(&usb->mPortLock);
+}
+
+static void handle_typec_uevent(Usb *usb, const char *msg)
+{
+  ALOGI("uevent received %s", msg);
+
+  // Handled right away, a pending role switch must not wait for the burst
+  // to settle.
+  // if (std::regex_match(cp, std::regex("(add)(.*)(-partner)")))
+  if (!strncmp(msg, "add@", 4) && !strncmp(msg + strlen(msg) - 8, "-partner", 8)) {
+     const char *partner = strrchr(msg, '/');
+     int idx = partner ? getPortNameIndex(std::string(partner + 1, strlen(partner + 1) - 8))
+                       : -1;
+
+     ALOGI("partner added");
+     pthread_mutex_lock(&usb->mPartnerLock);
+     usb->mPartnerUp = true;
+     pthread_cond_signal(&usb->mPartnerCV);
+     pthread_mutex_unlock(&usb->mPartnerLock);
+
+     if (idx >= 0)
+       finishModeSwitch(usb, idx, true);
+  }
+
+  updatePortFromUevent(usb, msg);
+}
+
+static int openGadgetAttr(int *fd, const char *path) {
+  if (*fd < 0)
+    *fd = open(fsPath(path).c_str(), O_RDWR | O_CLOEXEC);
+  if (*fd < 0)
+    ALOGE("open failed %s, errno=%d", path, errno);
+  return *fd;
+}
+
+static int writeGadgetAttr(int fd, const std::string &value) {
+  return pwrite(fd, value.c_str(), value.size(), 0) == (ssize_t)value.size() ? 0 : -1;
+}
+
+/*
+ * Reports the gadget as self-powered while a port is in PD mode and puts
+ * the saved MaxPower and bmAttributes back once none is. Only called on
+ * edges. MaxPower is flock()ed so that the gadget HAL does not re-apply
+ * the override while it is being lifted.
+ */
+static void setSelfPowered(struct Usb *usb, bool selfPowered) {
+  if (usb->mDryRun) {
+    usb->mSelfPowered = selfPowered;
+    return;
+  }
+
+  if (openGadgetAttr(&usb->mMaxPowerFd, GADGET_MAX_POWER_PATH) < 0 ||
+      openGadgetAttr(&usb->mAttributesFd, GADGET_ATTRIBUTES_PATH) < 0)
+    return;
+
+  flock(usb->mMaxPowerFd, LOCK_EX);
+  if (selfPowered) {
+    readFile(GADGET_MAX_POWER_PATH, &usb->mMaxPower);
+    readFile(GADGET_ATTRIBUTES_PATH, &usb->mAttributes);
+    writeGadgetAttr(usb->mMaxPowerFd, "0");
+    writeGadgetAttr(usb->mAttributesFd, "0xc0");
+  } else if (!usb->mMaxPower.empty()) {
+    writeGadgetAttr(usb->mMaxPowerFd, usb->mMaxPower);
+    writeGadgetAttr(usb->mAttributesFd, usb->mAttributes);
+    usb->mMaxPower = "";
+  }
+  android::base::SetProperty(PD_SELF_POWERED_PROP, selfPowered ? "1" : "0");
+  flock(usb->mMaxPowerFd, LOCK_UN);
+
+  usb->mSelfPowered = selfPowered;
+}
+
+/*
+ * Re-reads the ports touched by the last uevent burst and reports the
+ * result to the framework with a single callback.
+ */
+static void flushPortChanges(struct Usb *usb) {
+  if (!usb->mDirtyPorts && !usb->mRescanPending)
+    return;
+
+  char buf[PORT_ATTR_BUF_LEN];
+  bool selfPowered = false;
+
+  if (usb->mRescanPending) {
+    pthread_rwlock_wrlock(&usb->mPortLock);
+    rescanPortsLocked(usb);
+    pthread_rwlock_unlock(&usb->mPortLock);
+  }
+
+  lockPortsShared(usb);
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    struct PortInfo *port = &usb->mPorts[i];
+
+    // Ports were just re-read if the table had to be enumerated again.
+    bool dirty = (usb->mDirtyPorts & (1U << i)) && !usb->mRescanPending;
+
+    if (!port->present)
+      continue;
+
+    pthread_mutex_lock(&port->lock);
+    if (dirty || usb->mRescanPending) {
+      if (dirty)
+        refreshPortLocked(usb, i);
+      if (!readPortAttr(&port->attrs, port->name, PORT_ATTR_POWER_OP_MODE,
+                        buf, sizeof(buf)) && port->powerOpMode != buf) {
+        ALOGI("%s power_operation_mode %s", port->name.c_str(), buf);
+        port->powerOpMode = buf;
+      }
+    }
+    selfPowered = selfPowered || port->powerOpMode == "usb_power_delivery";
+    pthread_mutex_unlock(&port->lock);
+  }
+  pthread_rwlock_unlock(&usb->mPortLock);
+
+  usb->mDirtyPorts = 0;
+  usb->mRescanPending = false;
+
+  std::shared_ptr<const PortStatusSnapshot> snapshot = publishPortStatus(usb);
+
+  notifyPortStatus(usb, snapshot);
+
+  // Takes effect on the next enumeration, no need to hold up the callback.
+  if (selfPowered != usb->mSelfPowered)
+    setSelfPowered(usb, selfPowered);
+}
+
+static void timespecAddMs(struct timespec *ts, long ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static bool timespecBefore(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+/*
+ * (Re)arms the debounce timer so that the pending port changes get flushed
+ * once no typec uevent has arrived for debounce_ms, but never later than
+ * UEVENT_DEBOUNCE_MAX_WINDOWS windows after they were first seen.
+ */
+static void schedulePortFlush(struct data *payload) {
+  struct itimerspec its = {};
+  struct timespec now, limit;
+
+  if (payload->timer_fd < 0 || payload->debounce_ms <= 0) {
+    flushPortChanges(payload->usb);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!payload->flush_armed)
+    payload->dirty_since = now;
+
+  its.it_value = now;
+  timespecAddMs(&its.it_value, payload->debounce_ms);
+  limit = payload->dirty_since;
+  timespecAddMs(&limit, payload->debounce_ms * UEVENT_DEBOUNCE_MAX_WINDOWS);
+  if (timespecBefore(limit, its.it_value))
+    its.it_value = limit;
+
+  if (timerfd_settime(payload->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+    ALOGE("timerfd_settime failed; errno=%d", errno);
+    flushPortChanges(payload->usb);
+    return;
+  }
+  payload->flush_armed = true;
+}
+
+static void debounce_event(uint32_t /*epevents*/, struct data *payload) {
+  uint64_t expirations;
+
+  if (read(payload->timer_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+
+  payload->flush_armed = false;
+  flushPortChanges(payload->usb);
+}
+
+// Completes the port type switches whose partner did not come back
+// before their deadline, as failed.
+static void mode_switch_timeout_event(uint32_t /*epevents*/, struct data *payload) {
+  struct Usb *usb = payload->usb;
+  uint64_t expirations, nowUs;
+  uint32_t expired = 0;
+
+  // Nothing to do if the partner came back after the deadline fired.
+  if (read(usb->mModeSwitchTimerFd, &expirations, sizeof(expirations)) < 0)
+    return;
+
+  nowUs = latencyNowUs();
+  pthread_mutex_lock(&usb->mPartnerLock);
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    if (usb->mPorts[i].modeSwitchPending && usb->mPorts[i].modeSwitchDeadlineUs <= nowUs)
+      expired |= 1U << i;
+  pthread_mutex_unlock(&usb->mPartnerLock);
+
+  // The timer is armed again for the switches left.
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    if (expired & (1U << i))
+      finishModeSwitch(usb, i, false);
+}
+
+// Reads the moisture node. Reading it also re-arms its notification.
+static bool readContaminant(int fd, bool *detected) {
+  char buf[8];
+  ssize_t n;
+
+  do {
+    n = pread(fd, buf, sizeof(buf), 0);
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+    return false;
+
+  *detected = buf[0] == '1';
+  return true;
+}
+
+/*
+ * Reads the moisture source of port idx and acts upon a change of its
+ * contaminant presence: the port status is re-read and reported and the
+ * port is put back into DRP if it is disconnected. Called when the node is
+ * notified or, for drivers that do not notify it, on power_supply/usb
+ * uevents.
+ */
+static void checkContaminant(Usb *usb, int idx, int fd) {
+  struct PortInfo *port = &usb->mPorts[idx];
+  bool moisture_detected;
+  bool changed, disconnected;
+  std::string portName;
+
+  if (!readContaminant(fd, &moisture_detected))
+    return;
+
+  lockPortsShared(usb);
+  pthread_mutex_lock(&port->lock);
+  changed = port->contaminant != moisture_detected;
+  port->contaminant = moisture_detected;
+  if (changed && port->present)
+    refreshPortLocked(usb, idx);
+  disconnected = port->present && !port->connected;
+  portName = port->name;
+  pthread_mutex_unlock(&port->lock);
+  pthread_rwlock_unlock(&usb->mPortLock);
+
+  if (!changed)
+    return;
+  ALOGI("moisture: contaminant presence %s on port%d",
+        moisture_detected ? "detected" : "cleared", idx);
+
+  pthread_mutex_lock(&usb->mLock);
+  bool callback_V1_2 = usb->mCallbackVersion == CALLBACK_V1_2;
+  pthread_mutex_unlock(&usb->mLock);
+
+  // don't bother reporting if caller doesn't support USB HAL 1.2
+  // to report contaminant presence events
+  if (!callback_V1_2)
+    return;
+
+  notifyPortStatus(usb, publishPortStatus(usb));
+
+  if (disconnected) {
+    pthread_mutex_t *roleSwitchLock = getRoleSwitchLock(usb, portName);
+    bool pending;
+
+    //Role switch is not in progress and port is in disconnected state
+    if (pthread_mutex_trylock(roleSwitchLock))
+      return;
+
+    pthread_mutex_lock(&usb->mPartnerLock);
+    pending = port->modeSwitchPending;
+    pthread_mutex_unlock(&usb->mPartnerLock);
+
+    if (!pending) {
+      //PortRole role = {.role = static_cast<uint32_t>(PortMode::UFP)};
+      switchToDrp(portName);
+    }
+    pthread_mutex_unlock(roleSwitchLock);
+  }
+}
+
+// A moisture node was notified through sysfs_notify(). Only the notified
+// nodes have anything to read, the others stay unchanged.
+static void contaminant_event(uint32_t /*epevents*/, struct data *payload) {
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    if (payload->contaminant_notified & (1u << i))
+      checkContaminant(payload->usb, i, payload->contaminant_fds[i]);
+  }
+}
+
+// process POWER_SUPPLY uevent for contaminant presence
+static void handle_psy_uevent(struct data *payload, const char *msg)
+{
+  bool polled = false;
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    polled = polled || (payload->contaminant_fds[i] >= 0 &&
+                        !(payload->contaminant_notified & (1u << i)));
+  if (!polled)
+    return;
+
+  while (*msg) {
+    if (!strncmp(msg, "POWER_SUPPLY_NAME=", 18)) {
+      msg += 18;
+      if (strcmp(msg, "usb")) // make sure we're looking at the correct uevent
+        return;
+      else
+        break;
+    }
+
+    // advance to after the next \0
+    while (*msg++) ;
+  }
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    if (payload->contaminant_fds[i] >= 0 && !(payload->contaminant_notified & (1u << i)))
+      checkContaminant(payload->usb, i, payload->contaminant_fds[i]);
+  }
+}
+
+// Matches "\d\.auto/usb\d/\d-\d(?:/[\d\.-]+)*" against the whole of tail.
+static bool matchXhciDeviceTail(std::string_view tail) {
+  if (tail.size() < 15 || !isdigit(tail[0]) || tail.substr(1, 9) != ".auto/usb" ||
+      !isdigit(tail[10]) || tail[11] != '/' || !isdigit(tail[12]) || tail[13] != '-' ||
+      !isdigit(tail[14]))
+    return false;
+
+  tail.remove_prefix(15);
+  while (!tail.empty()) {
+    size_t n = 1;
+
+    if (tail[0] != '/')
+      return false;
+    while (n < tail.size() && (isdigit(tail[n]) || tail[n] == '.' || tail[n] == '-'))
+      n++;
+    if (n == 1)
+      return false;
+    tail.remove_prefix(n);
+  }
+
+  return true;
+}
+
+/*
+ * Single pass, allocation free equivalent of std::regex_match against
+ *   <action>@(/devices/platform/soc/.*dwc3/xhci-hcd\.\d\.auto/usb\d/\d-\d(?:/[\d\.-]+)*)
+ * when intf is NULL, or the same DEVPATH followed by /([^/]*:[^/]*) when it
+ * is not. On a match *devpath and *intf point into msg.
+ */
+bool matchUsbUevent(const char *msg, std::string_view action, std::string_view *devpath,
+                    std::string_view *intf) {
+  static constexpr std::string_view socPrefix = "/devices/platform/soc/";
+  static constexpr std::string_view xhci = "dwc3/xhci-hcd.";
+  std::string_view path(msg);
+
+  if (path.size() <= action.size() || path.compare(0, action.size(), action) ||
+      path[action.size()] != '@')
+    return false;
+  path.remove_prefix(action.size() + 1);
+
+  if (intf != NULL) {
+    // Interface names are the only component that may contain a ':'.
+    size_t slash = path.rfind('/');
+    if (slash == std::string_view::npos ||
+        path.find(':', slash) == std::string_view::npos)
+      return false;
+    *intf = path.substr(slash + 1);
+    path = path.substr(0, slash);
+  }
+
+  if (path.compare(0, socPrefix.size(), socPrefix))
+    return false;
+
+  // The greedy ".*" may swallow earlier "dwc3/xhci-hcd." occurrences.
+  for (size_t pos = path.find(xhci, socPrefix.size()); pos != std::string_view::npos;
+       pos = path.find(xhci, pos + 1)) {
+    if (matchXhciDeviceTail(path.substr(pos + xhci.size()))) {
+      *devpath = path;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Only the first string of a uevent, "<action>@<DEVPATH>", is looked at by
+ * uevent_event(). Every uevent it acts upon has one of these in its
+ * DEVPATH: "/typec/", "/power_supply/usb" or ".../dwc3/xhci-hcd...".
+ */
+static const char ueventFilterTokens[][4] = {
+  { 'y', 'p', 'e', 'c' },
+  { 'y', '/', 'u', 's' },
+  { 'x', 'h', 'c', 'i' },
+};
+
+// What the socket filter of attachUeventFilter() lets through, for counting
+// its effect while it is detached.
+static bool ueventFilterPasses(const char *msg, int n) {
+  const int ntokens = sizeof(ueventFilterTokens) / sizeof(ueventFilterTokens[0]);
+
+  for (int k = 0; k < UEVENT_FILTER_SCAN_LEN && k + 4 <= n; k++)
+    for (int t = 0; t < ntokens; t++)
+      if (!memcmp(msg + k, ueventFilterTokens[t], 4))
+        return true;
+
+  return false;
+}
+
+// Devices with a matching interface by DEVPATH, along with their rule
+typedef std::vector<std::pair<std::string, const struct AutoSuspendRule *>> AutoSuspendBatch;
+
+/*
+ * Acts upon a single uevent of n bytes; msg has room for two more.
+ * Devices whose interfaces are bound are added to batch rather than
+ * handled right away.
+ */
+static void dispatchUevent(struct data *payload, char *msg, int n, AutoSuspendBatch *batch) {
+  std::string_view devpath, intf;
+
+  msg[n] = '\0';
+  msg[n + 1] = '\0';
+
+  payload->usb->mUeventsDelivered++;
+  if (!payload->usb->mUeventFilterAttached && !ueventFilterPasses(msg, n))
+    payload->usb->mUeventsFilterable++;
 
   if (strstr(msg, "typec/port")) {
     handle_typec_uevent(payload->usb, msg);
   } else if (strstr(msg, "power_supply/usb")) {
-    handle_psy_uevent(payload->usb, msg + strlen(msg) + 1);
-  } else if (std::regex_match(msg, match, add_regex)) {
-    if (match.size() == 2) {
-      std::csub_match submatch = match[1];
-      checkUsbDeviceAutoSuspend("/sys" +  submatch.str());
+    handle_psy_uevent(payload, msg + strlen(msg) + 1);
+  } else if (matchUsbUevent(msg, "add", &devpath, NULL)) {
+    checkUsbDeviceAutoSuspend(payload->usb, "/sys" + std::string(devpath));
+  } else if (!payload->usb->mIgnoreWakeup &&
+             matchUsbUevent(msg, "bind", &devpath, &intf)) {
+    // A device binds all its interfaces in one burst, its power
+    // attributes are written once the burst has been drained.
+    bool batched = false;
+    for (const auto &device : *batch)
+      batched = batched || device.first == devpath;
+
+    if (!batched) {
+      std::string devicePath = "/sys" + std::string(devpath);
+      const struct AutoSuspendRule *rule =
+          interfaceAutoSuspendRule(payload->usb, devicePath, std::string(intf));
+      if (rule)
+        batch->emplace_back(std::string(devpath), rule);
     }
-  } else if (!payload->usb->mIgnoreWakeup && std::regex_match(msg, match, bind_regex)) {
-    if (match.size() == 3) {
-      std::csub_match devpath = match[1];
-      std::csub_match intfpath = match[2];
-      checkUsbInterfaceAutoSuspend("/sys" + devpath.str(), intfpath.str());
+  } else {
+    return;
+  }
+  payload->usb->mUeventsHandled++;
+}
+
+static void flushAutoSuspendBatch(struct Usb *usb, AutoSuspendBatch *batch) {
+  for (const auto &device : *batch) {
+    ALOGI("auto suspend usb interfaces /sys%s", device.first.c_str());
+    if (!usb->mDryRun)
+      applyAutoSuspendRule("/sys" + device.first, *device.second);
+  }
+  batch->clear();
+}
+
+/*
+ * Appends a uevent to the log: its CLOCK_MONOTONIC time in us and its
+ * length, both in host byte order, followed by the n bytes of the uevent.
+ */
+static void recordUevent(struct data *payload, const char *msg, int n) {
+  struct UeventRecord record = {latencyNowUs(), (uint32_t)n};
+  struct iovec iov[2] = {
+    {&record, sizeof(record)},
+    {(void *)msg, (size_t)n},
+  };
+
+  if (writev(payload->record_fd, iov, 2) != (ssize_t)(sizeof(record) + n)) {
+    ALOGE("failed to record uevent, recording stopped; errno=%d", errno);
+    close(payload->record_fd);
+    payload->record_fd = -1;
+  }
+}
+
+static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
+  char msg[UEVENT_MSG_LEN + 2];
+  int n;
+  AutoSuspendBatch autoSuspendBatch;
+  ScopedLatency latency(&payload->usb->mUeventLatency);
+
+  // Drain the whole burst; typec changes are reported once it settles.
+  while ((n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN)) > 0) {
+    if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
+      continue;
+
+    if (payload->record_fd >= 0)
+      recordUevent(payload, msg, n);
+    dispatchUevent(payload, msg, n, &autoSuspendBatch);
+  }
+
+  flushAutoSuspendBatch(payload->usb, &autoSuspendBatch);
+
+  if (payload->usb->mDirtyPorts || payload->usb->mRescanPending)
+    schedulePortFlush(payload);
+}
+
+/*
+ * Feeds a uevent log through dispatchUevent() as if the uevents came from
+ * the socket. Gaps of at least the debounce window end a burst, just like
+ * on the socket, only that the burst is flushed right away. payload is the
+ * scratch one of replayUeventsDryRun(), the worker keeps serving live
+ * uevents meanwhile.
+ */
+static void replayUevents(struct data *payload, struct UeventReplay *replay) {
+  std::string log;
+  char msg[UEVENT_MSG_LEN + 2];
+  AutoSuspendBatch autoSuspendBatch;
+  const size_t magicLen = strlen(UEVENT_LOG_MAGIC);
+  uint64_t startUs = latencyNowUs(), firstUs = 0;
+  size_t pos = magicLen;
+
+  if (!android::base::ReadFileToString(replay->path, &log)) {
+    replay->result = errno ? errno : EIO;
+    return;
+  }
+  if (log.compare(0, magicLen, UEVENT_LOG_MAGIC)) {
+    replay->result = EINVAL;
+    return;
+  }
+
+  while (pos + sizeof(struct UeventRecord) <= log.size()) {
+    struct UeventRecord record, next;
+    uint64_t beginUs;
+
+    memcpy(&record, log.data() + pos, sizeof(record));
+    pos += sizeof(record);
+    if (record.length >= UEVENT_MSG_LEN || pos + record.length > log.size()) {
+      replay->result = EINVAL;
+      break;
     }
+
+    if (replay->events == 0)
+      firstUs = record.timestampUs;
+    if (replay->speedup) {
+      uint64_t dueUs = startUs + (record.timestampUs - firstUs) / replay->speedup;
+      uint64_t nowUs = latencyNowUs();
+      if (dueUs > nowUs)
+        usleep(dueUs - nowUs);
+    }
+
+    memcpy(msg, log.data() + pos, record.length);
+    pos += record.length;
+
+    beginUs = latencyNowUs();
+    dispatchUevent(payload, msg, record.length, &autoSuspendBatch);
+
+    bool last = pos + sizeof(next) > log.size();
+    if (!last)
+      memcpy(&next, log.data() + pos, sizeof(next));
+    if (last || next.timestampUs - record.timestampUs >= (uint64_t)payload->debounce_ms * 1000) {
+      flushAutoSuspendBatch(payload->usb, &autoSuspendBatch);
+      if (payload->usb->mDirtyPorts || payload->usb->mRescanPending)
+        flushPortChanges(payload->usb);
+    }
+    replay->latency.record(latencyNowUs() - beginUs);
+    replay->events++;
+  }
+
+  replay->elapsedUs = latencyNowUs() - startUs;
+  replay->handled = payload->usb->mUeventsHandled;
+}
+
+/*
+ * Replays into a scratch instance that has no callback and never writes
+ * sysfs or configfs, so that neither the live port table and counters nor
+ * the framework and the hardware see the recorded uevents. Its port table
+ * is read from sysfs like the live one.
+ */
+void replayUeventsDryRun(const Usb *live, struct UeventReplay *replay, int debounceMs) {
+  sp<Usb> scratch = new Usb(live);
+  struct data scratchPayload = {};
+
+  scratchPayload.uevent_fd = -1;
+  scratchPayload.timer_fd = -1;
+  scratchPayload.debounce_ms = debounceMs;
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    scratchPayload.contaminant_fds[i] = -1;
+  scratchPayload.record_fd = -1;
+  scratchPayload.usb = scratch.get();
+  replayUevents(&scratchPayload, replay);
+}
+
+/*
+ * Classic BPF cannot loop, so the token search is unrolled over the first
+ * UEVENT_FILTER_SCAN_LEN offsets of the message: a 32 bit load at each
+ * offset followed by a compare against every token. Loads past the end of
+ * the message abort the program, which drops the message. False positives
+ * are fine as uevent_event() still does the exact matching.
+ */
+static int attachUeventFilter(int uevent_fd) {
+  const int ntokens = sizeof(ueventFilterTokens) / sizeof(ueventFilterTokens[0]);
+  std::vector<struct sock_filter> insns;
+  struct sock_fprog prog;
+
+  insns.reserve(UEVENT_FILTER_SCAN_LEN * (ntokens + 2) + 1);
+  for (uint32_t k = 0; k < UEVENT_FILTER_SCAN_LEN; k++) {
+    insns.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, k));
+    for (int t = 0; t < ntokens; t++) {
+      // Words are loaded in network byte order.
+      uint32_t word = (uint8_t)ueventFilterTokens[t][0] << 24 |
+                      (uint8_t)ueventFilterTokens[t][1] << 16 |
+                      (uint8_t)ueventFilterTokens[t][2] << 8 |
+                      (uint8_t)ueventFilterTokens[t][3];
+      insns.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, word,
+                               (uint8_t)(ntokens - 1 - t),
+                               (uint8_t)(t == ntokens - 1 ? 1 : 0)));
+    }
+    insns.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+  }
+  insns.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+  prog.len = insns.size();
+  prog.filter = insns.data();
+  if (setsockopt(uevent_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+    ALOGE("failed to attach uevent filter; errno=%d", errno);
+    return -1;
   }
+
+  return 0;
 }
 
 void *work(void *param) {
-  int epoll_fd, uevent_fd;
+  int epoll_fd, uevent_fd, mode_switch_fd = -1;
   struct epoll_event ev;
   int nevents = 0;
   struct data payload;
@@ -782,9 +2059,22 @@ void *work(void *param) {
 
   payload.uevent_fd = uevent_fd;
   payload.usb = (android::hardware::usb::V1_2::implementation::Usb *)param;
+  payload.debounce_ms = android::base::GetIntProperty(UEVENT_DEBOUNCE_PROP,
+                                                      UEVENT_DEBOUNCE_MS);
+  payload.flush_armed = false;
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    payload.contaminant_fds[i] = -1;
+  payload.contaminant_notified = 0;
+  payload.record_fd = -1;
+  payload.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (payload.timer_fd < 0)
+    ALOGE("timerfd_create failed, uevents will not be debounced; errno=%d", errno);
 
   fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
 
+  if (android::base::GetBoolProperty(UEVENT_FILTER_PROP, true))
+    payload.usb->mUeventFilterAttached = !attachUeventFilter(uevent_fd);
+
   ev.events = EPOLLIN;
   ev.data.ptr = (void *)uevent_event;
 
@@ -799,6 +2089,94 @@ void *work(void *param) {
     goto error;
   }
 
+  if (payload.timer_fd >= 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = (void *)debounce_event;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, payload.timer_fd, &ev) == -1) {
+      ALOGE("epoll_ctl failed for timerfd; errno=%d", errno);
+      close(payload.timer_fd);
+      payload.timer_fd = -1;
+    }
+  }
+
+  mode_switch_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (mode_switch_fd >= 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = (void *)mode_switch_timeout_event;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mode_switch_fd, &ev) == -1) {
+      ALOGE("epoll_ctl failed for role switch timerfd; errno=%d", errno);
+      close(mode_switch_fd);
+      mode_switch_fd = -1;
+    }
+  } else {
+    ALOGE("timerfd_create failed, role switches will block; errno=%d", errno);
+  }
+
+  pthread_mutex_lock(&payload.usb->mPartnerLock);
+  payload.usb->mModeSwitchTimerFd = mode_switch_fd;
+  pthread_mutex_unlock(&payload.usb->mPartnerLock);
+
+  {
+    std::string record = android::base::GetProperty(UEVENT_RECORD_PROP, "");
+    if (!record.empty()) {
+      payload.record_fd = open(record.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                               0600);
+      if (payload.record_fd < 0) {
+        ALOGE("failed to open %s; errno=%d", record.c_str(), errno);
+      } else {
+        struct stat st;
+        // A new log starts with the magic.
+        if (!fstat(payload.record_fd, &st) && st.st_size == 0)
+          write(payload.record_fd, UEVENT_LOG_MAGIC, strlen(UEVENT_LOG_MAGIC));
+        ALOGI("recording uevents to %s", record.c_str());
+      }
+    }
+  }
+
+  pthread_mutex_lock(&payload.usb->mReplayLock);
+  payload.usb->mUeventFd = uevent_fd;
+  pthread_mutex_unlock(&payload.usb->mReplayLock);
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    // Set once at startup, read without locks.
+    const std::string &path = payload.usb->mPorts[i].contaminantPath;
+    bool detected;
+    int fd;
+
+    if (path.empty())
+      continue;
+
+    fd = open(fsPath(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      ALOGE("failed to open %s; errno=%d", path.c_str(), errno);
+      continue;
+    }
+    payload.contaminant_fds[i] = fd;
+
+    // Arms the notification. Changes since discoverPlatform() are reported
+    // with the first port scan.
+    if (readContaminant(fd, &detected)) {
+      pthread_mutex_lock(&payload.usb->mPorts[i].lock);
+      payload.usb->mPorts[i].contaminant = detected;
+      pthread_mutex_unlock(&payload.usb->mPorts[i].lock);
+    }
+
+    /*
+     * Every sysfs attribute can be polled, but only the ones whose driver
+     * calls sysfs_notify() ever wake up. The IIO channel is not one of them,
+     * CONTAMINANT_NOTIFY_PROP tells whether the nodes of this platform are.
+     */
+    if (android::base::GetBoolProperty(CONTAMINANT_NOTIFY_PROP,
+                                       path.find("/iio:") == std::string::npos)) {
+      ev.events = EPOLLPRI | EPOLLERR;
+      ev.data.ptr = (void *)contaminant_event;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        ALOGE("epoll_ctl failed for %s; errno=%d", path.c_str(), errno);
+      else
+        payload.contaminant_notified |= 1u << i;
+    }
+  }
+
   while (!destroyThread) {
     struct epoll_event events[64];
 
@@ -816,10 +2194,31 @@ void *work(void *param) {
     }
   }
 
-  ALOGI("exiting worker thread");
+  ALOGI("exiting worker thread, uevents delivered:%" PRIu64 " handled:%" PRIu64,
+        payload.usb->mUeventsDelivered.load(), payload.usb->mUeventsHandled.load());
 error:
+  pthread_mutex_lock(&payload.usb->mPartnerLock);
+  payload.usb->mModeSwitchTimerFd = -1;
+  pthread_mutex_unlock(&payload.usb->mPartnerLock);
+
+  pthread_mutex_lock(&payload.usb->mReplayLock);
+  payload.usb->mUeventFd = -1;
+  pthread_mutex_unlock(&payload.usb->mReplayLock);
+
+  // Nobody is left to see the partner come back.
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    finishModeSwitch(payload.usb, i, false);
   close(uevent_fd);
 
+  if (mode_switch_fd >= 0) close(mode_switch_fd);
+
+  if (payload.record_fd >= 0) close(payload.record_fd);
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++)
+    if (payload.contaminant_fds[i] >= 0) close(payload.contaminant_fds[i]);
+
+  if (payload.timer_fd >= 0) close(payload.timer_fd);
+
   if (epoll_fd >= 0) close(epoll_fd);
 
   return NULL;
@@ -839,9 +2238,12 @@ Return<void> Usb::setCallback(const sp<V1_0::IUsbCallback> &callback) {
   sp<V1_1::IUsbCallback> callback_V1_1 = V1_1::IUsbCallback::castFrom(callback);
   sp<IUsbCallback> callback_V1_2 = IUsbCallback::castFrom(callback);
 
-  if (callback != NULL)
-      if (callback_V1_1 == NULL)
-          ALOGI("Registering 1.0 callback");
+  CallbackVersion version = callback_V1_2 != NULL ? CALLBACK_V1_2 :
+                            callback_V1_1 != NULL ? CALLBACK_V1_1 :
+                            callback != NULL ? CALLBACK_V1_0 : CALLBACK_NONE;
+
+  if (version == CALLBACK_V1_0)
+      ALOGI("Registering 1.0 callback");
 
   pthread_mutex_lock(&mLock);
   /*
@@ -854,15 +2256,21 @@ Return<void> Usb::setCallback(const sp<V1_0::IUsbCallback> &callback) {
   if ((mCallback_1_0 == NULL && callback == NULL) ||
       (mCallback_1_0 != NULL && callback != NULL)) {
     /*
-     * Always store as V1_0 callback object. Type cast to V1_1
-     * when the callback is actually invoked.
+     * Store the V1_0 callback object along with its V1_1 and V1_2
+     * casts so that they need not be resolved when it is invoked.
      */
     mCallback_1_0 = callback;
+    mCallback_1_1 = callback_V1_1;
+    mCallback_1_2 = callback_V1_2;
+    mCallbackVersion = version;
     pthread_mutex_unlock(&mLock);
     return Void();
   }
 
   mCallback_1_0 = callback;
+  mCallback_1_1 = callback_V1_1;
+  mCallback_1_2 = callback_V1_2;
+  mCallbackVersion = version;
   ALOGI("registering callback");
 
   // Kill the worker thread if the new callback is NULL.
@@ -885,66 +2293,139 @@ Return<void> Usb::setCallback(const sp<V1_0::IUsbCallback> &callback) {
   if (pthread_create(&mPoll, NULL, work, this)) {
     ALOGE("pthread creation failed %d", errno);
     mCallback_1_0 = NULL;
+    mCallback_1_1 = NULL;
+    mCallback_1_2 = NULL;
+    mCallbackVersion = CALLBACK_NONE;
   }
 
   pthread_mutex_unlock(&mLock);
 
-  checkUsbWakeupSupport(this);
-
   /*
-   * Check for the correct path to detect contaminant presence status
-   * from the possible paths and use that to get contaminant
-   * presence status when required.
+   * Devices that show up from here on are set up from their add/bind
+   * uevents. The ones that are already enumerated are swept once, off the
+   * binder thread.
    */
-  if (access("/sys/class/power_supply/usb/moisture_detected", R_OK) == 0) {
-    mContaminantStatusPath = "/sys/class/power_supply/usb/moisture_detected";
-  } else if (access("/sys/class/qcom-battery/moisture_detection_status", R_OK) == 0) {
-    mContaminantStatusPath = "/sys/class/qcom-battery/moisture_detection_status";
-  } else if (access("/sys/bus/iio/devices/iio:device4/in_index_usb_moisture_detected_input", R_OK) == 0) {
-    mContaminantStatusPath = "/sys/bus/iio/devices/iio:device4/in_index_usb_moisture_detected_input";
-  } else {
-    mContaminantStatusPath.clear();
+  if (!mIgnoreWakeup && !mAutoSuspendSwept.exchange(true)) {
+    pthread_t sweep;
+    if (pthread_create(&sweep, NULL, autoSuspendSweep, this))
+      ALOGE("autosuspend sweep creation failed %d", errno);
+    else
+      pthread_detach(sweep);
   }
 
-  ALOGI("Contamination presence path: %s", mContaminantStatusPath.c_str());
+  pthread_rwlock_wrlock(&mPortLock);
+  rescanPortsLocked(this);
+  pthread_rwlock_unlock(&mPortLock);
+  publishPortStatus(this);
 
   return Void();
 }
 
-static void checkUsbWakeupSupport(struct Usb *usb) {
+// sysfs nodes that report contaminant presence, in order of preference.
+static const char *const contaminantStatusPaths[] = {
+  "/sys/class/power_supply/usb/moisture_detected",
+  "/sys/class/qcom-battery/moisture_detection_status",
+  "/sys/bus/iio/devices/iio:device4/in_index_usb_moisture_detected_input",
+};
+
+// Whether the first USB controller has a power/wakeup node.
+static bool controllerSupportsWakeup() {
   std::string platdevices = "/sys/bus/platform/devices/";
-  DIR *pd = opendir(platdevices.c_str());
+  DIR *pd = opendir(fsPath(platdevices).c_str());
+  bool supported = true;
+
   if (pd != NULL) {
     struct dirent *platDir;
     while ((platDir = readdir(pd))) {
       std::string cname = platDir->d_name;
       /*
        * Scan for USB controller. Here "susb" takes care of both hsusb and ssusb.
-       * Set mIgnoreWakeup based on the availability of 1st Controller's
-       * power/wakeup node.
+       * Decide based on the availability of 1st Controller's power/wakeup node.
        */
       if (strstr(platDir->d_name, "susb")) {
-	if (faccessat(dirfd(pd), (cname + "/power/wakeup").c_str(), F_OK, 0) < 0) {
-	  usb->mIgnoreWakeup = true;
-	  ALOGI("PLATFORM DOESN'T SUPPORT WAKEUP");
-	} else {
-	  usb->mIgnoreWakeup = false;
-	}
-	break;
+        supported = faccessat(dirfd(pd), (cname + "/power/wakeup").c_str(), F_OK, 0) == 0;
+        break;
       }
     }
     closedir(pd);
   }
 
+  return supported;
+}
+
+/*
+ * Resolves the wakeup support and the moisture source of every port number,
+ * probing sysfs only when no earlier instance of the HAL did so since boot.
+ * Sources given by CONTAMINANT_PATH_PROP_PREFIX properties are taken as is.
+ */
+static void discoverPlatform(struct Usb *usb) {
+  std::string wakeup = android::base::GetProperty(USB_WAKEUP_CACHE_PROP, "");
+  std::string contaminant = android::base::GetProperty(CONTAMINANT_PATH_CACHE_PROP, "");
+
+  if (wakeup.empty()) {
+    wakeup = controllerSupportsWakeup() ? "1" : "0";
+    android::base::SetProperty(USB_WAKEUP_CACHE_PROP, wakeup);
+  }
+  usb->mIgnoreWakeup = wakeup != "1";
   if (usb->mIgnoreWakeup)
-    return;
+    ALOGI("PLATFORM DOESN'T SUPPORT WAKEUP");
+
+  if (contaminant.empty()) {
+    contaminant = "none";
+    for (const char *path : contaminantStatusPaths) {
+      if (access(fsPath(path).c_str(), R_OK) == 0) {
+        contaminant = path;
+        break;
+      }
+    }
+    android::base::SetProperty(CONTAMINANT_PATH_CACHE_PROP, contaminant);
+  }
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    struct PortInfo *port = &usb->mPorts[i];
+    std::string path = android::base::GetProperty(
+        CONTAMINANT_PATH_PROP_PREFIX "port" + std::to_string(i), i ? "none" : contaminant);
+    std::string presence;
+
+    if (path == "none")
+      continue;
+
+    port->contaminantPath = path;
+    port->contaminant = !readFile(path, &presence) && presence == "1";
+    ALOGI("Contamination presence path of port%d: %s", i, path.c_str());
+  }
+}
+
+/*
+ * Takes what discoverPlatform() and loadAutoSuspendRules() found for the
+ * live instance, so that scratch instances neither probe sysfs nor set
+ * properties. Contaminant presence is read afresh like at startup.
+ */
+static void inheritPlatform(struct Usb *usb, const struct Usb *live) {
+  usb->mIgnoreWakeup = live->mIgnoreWakeup;
+  usb->mDeviceRules = live->mDeviceRules;
+  usb->mClassRules = live->mClassRules;
+
+  for (int i = 0; i < MAX_TYPEC_PORTS; i++) {
+    struct PortInfo *port = &usb->mPorts[i];
+    std::string presence;
+
+    // Set once at startup, read without locks.
+    port->contaminantPath = live->mPorts[i].contaminantPath;
+    if (!port->contaminantPath.empty())
+      port->contaminant = !readFile(port->contaminantPath, &presence) && presence == "1";
+  }
+}
+
+/*
+ * Enables autosuspend on the USB devices that were enumerated before the
+ * HAL started listening to uevents. Runs once, on its own thread.
+ */
+static void *autoSuspendSweep(void *param) {
+  struct Usb *usb = (struct Usb *)param;
 
-  /*
-   * If wakeup is supported then scan for enumerated USB devices and
-   * enable autosuspend.
-   */
   std::string usbdevices = "/sys/bus/usb/devices/";
-  DIR *dp = opendir(usbdevices.c_str());
+  DIR *dp = opendir(fsPath(usbdevices).c_str());
   if (dp != NULL) {
     struct dirent *deviceDir;
     struct dirent *intfDir;
@@ -957,12 +2438,16 @@ static void checkUsbWakeupSupport(struct Usb *usb) {
        */
       if (deviceDir->d_type == DT_LNK && !strchr(deviceDir->d_name, ':')) {
         char buf[PATH_MAX];
-        if (realpath((usbdevices + deviceDir->d_name).c_str(), buf)) {
+        if (realpath(fsPath(usbdevices + deviceDir->d_name).c_str(), buf)) {
 
           ip = opendir(buf);
           if (ip == NULL)
             continue;
 
+          // Like the DEVPATH of a uevent, resolved against the root again.
+          std::string devicePath = fsUnroot(buf);
+          checkUsbDeviceAutoSuspend(usb, devicePath);
+
           while ((intfDir = readdir(ip))) {
             // Scan over all the interfaces that are part of the device
             if (intfDir->d_type == DT_DIR && strchr(intfDir->d_name, ':')) {
@@ -970,7 +2455,9 @@ static void checkUsbWakeupSupport(struct Usb *usb) {
                * If the autosuspend is successfully enabled, no need
                * to iterate over other interfaces.
                */
-              if (checkUsbInterfaceAutoSuspend(buf, intfDir->d_name))
+              const struct AutoSuspendRule *rule =
+                  interfaceAutoSuspendRule(usb, devicePath, intfDir->d_name);
+              if (rule && !applyAutoSuspendRule(devicePath, *rule))
                 break;
             }
           }
@@ -980,72 +2467,135 @@ static void checkUsbWakeupSupport(struct Usb *usb) {
     }
     closedir(dp);
   }
+  ALOGI("autosuspend sweep done");
+  return NULL;
 }
 
 /*
- * allow specific USB device idProduct and idVendor to auto suspend
+ * Rules used when AUTOSUSPEND_RULES_PATH is missing: the Google USB-C to
+ * 3.5mm adapter, audio and hub class devices.
  */
-static bool canProductAutoSuspend(const std::string &deviceIdVendor,
-    const std::string &deviceIdProduct) {
-  if (deviceIdVendor == GOOGLE_USB_VENDOR_ID_STR &&
-      deviceIdProduct == GOOGLE_USBC_35_ADAPTER_UNPLUGGED_ID_STR) {
-    return true;
+static const char defaultAutoSuspendRules[] =
+    "device 18d1 5029 auto enabled -\n"
+    "class 01 auto enabled -\n"
+    "class 09 auto enabled -\n";
+
+static std::string ruleValue(const std::string &field) {
+  return field == "-" ? "" : field;
+}
+
+/*
+ * Parses rule lines of the form
+ *
+ *   device <idVendor> <idProduct> <control> <wakeup> <autosuspend_delay_ms>
+ *   class <bInterfaceClass> <control> <wakeup> <autosuspend_delay_ms>
+ *
+ * with the IDs and the class in hex and "-" for attributes to leave alone.
+ */
+static void loadAutoSuspendRules(struct Usb *usb) {
+  std::string rules;
+
+  if (!android::base::ReadFileToString(fsPath(AUTOSUSPEND_RULES_PATH), &rules))
+    rules = defaultAutoSuspendRules;
+
+  std::vector<std::string> lines = android::base::Split(rules, "\n");
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::vector<std::string> fields;
+    struct AutoSuspendRule rule;
+
+    for (const std::string &field :
+         android::base::Split(android::base::Trim(lines[i].substr(0, lines[i].find('#'))), " \t"))
+      if (!field.empty()) fields.push_back(field);
+
+    if (fields.empty())
+      continue;
+
+    if (fields[0] == "device" && fields.size() == 6) {
+      unsigned long vid, pid;
+      if (!parseHex(fields[1], 0xffff, &vid) || !parseHex(fields[2], 0xffff, &pid))
+        goto malformed;
+
+      rule = {ruleValue(fields[3]), ruleValue(fields[4]), ruleValue(fields[5])};
+      usb->mDeviceRules[vid << 16 | pid] = rule;
+    } else if (fields[0] == "class" && fields.size() == 5) {
+      unsigned long interfaceClass;
+      if (!parseHex(fields[1], 0xff, &interfaceClass))
+        goto malformed;
+
+      rule = {ruleValue(fields[2]), ruleValue(fields[3]), ruleValue(fields[4])};
+      usb->mClassRules[interfaceClass] = rule;
+    } else {
+      goto malformed;
+    }
+    continue;
+
+malformed:
+    ALOGE("malformed autosuspend rule at line %zu", i + 1);
   }
-  return false;
+
+  ALOGI("%zu device and %zu class autosuspend rules", usb->mDeviceRules.size(),
+        usb->mClassRules.size());
 }
 
-static bool canUsbDeviceAutoSuspend(const std::string &devicePath) {
-  std::string deviceIdVendor;
-  std::string deviceIdProduct;
-  readFile(devicePath + "/idVendor", &deviceIdVendor);
-  readFile(devicePath + "/idProduct", &deviceIdProduct);
+static int applyAutoSuspendRule(const std::string &devicePath,
+                                const struct AutoSuspendRule &rule) {
+  int ret = 0;
 
-  // deviceIdVendor and deviceIdProduct will be empty strings if readFile fails
-  return canProductAutoSuspend(deviceIdVendor, deviceIdProduct);
+  if (!rule.delayMs.empty())
+    ret = writeFile(devicePath + "/power/autosuspend_delay_ms", rule.delayMs);
+  if (!ret && !rule.control.empty())
+    ret = writeFile(devicePath + "/power/control", rule.control);
+  if (!ret && !rule.wakeup.empty())
+    ret = writeFile(devicePath + "/power/wakeup", rule.wakeup);
+
+  return ret;
 }
 
 /*
  * function to consume USB device plugin events (on receiving a
- * USB device path string), and enable autosupend on the USB device if
- * necessary.
+ * USB device path string), and apply the autosuspend rule of the
+ * device if there is one.
  */
-static void checkUsbDeviceAutoSuspend(const std::string& devicePath) {
+static void checkUsbDeviceAutoSuspend(struct Usb *usb, const std::string& devicePath) {
+  unsigned long vid, pid;
+
+  if (usb->mDeviceRules.empty())
+    return;
+
+  // The device may be gone already.
+  if (!readHexAttr(devicePath + "/idVendor", 0xffff, &vid) ||
+      !readHexAttr(devicePath + "/idProduct", 0xffff, &pid))
+    return;
+
   /*
    * Currently we only actively enable devices that should be autosuspended, and leave others
    * to the defualt.
    */
-  if (canUsbDeviceAutoSuspend(devicePath)) {
+  auto rule = usb->mDeviceRules.find(vid << 16 | pid);
+  if (rule != usb->mDeviceRules.end()) {
     ALOGI("auto suspend usb device %s", devicePath.c_str());
-    writeFile(devicePath + "/power/control", "auto");
-    writeFile(devicePath + "/power/wakeup", "enabled");
+    if (!usb->mDryRun)
+      applyAutoSuspendRule(devicePath, rule->second);
   }
 }
 
-static bool checkUsbInterfaceAutoSuspend(const std::string& devicePath,
-        const std::string &intf) {
-  std::string bInterfaceClass;
-  int interfaceClass, ret = -1;
+// The rule for the class of the interface, NULL if there is none.
+static const struct AutoSuspendRule *interfaceAutoSuspendRule(struct Usb *usb,
+        const std::string& devicePath, const std::string &intf) {
+  unsigned long interfaceClass;
 
-  readFile(devicePath + "/" + intf + "/bInterfaceClass", &bInterfaceClass);
-  interfaceClass = std::stoi(bInterfaceClass, 0, 16);
+  // The interface may have gone away since it was bound.
+  if (!readHexAttr(devicePath + "/" + intf + "/bInterfaceClass", 0xff, &interfaceClass))
+    return NULL;
 
   // allow autosuspend for certain class devices
-  switch (interfaceClass) {
-    case USB_CLASS_AUDIO:
-    case USB_CLASS_HUB:
-      ALOGI("auto suspend usb interfaces %s", devicePath.c_str());
-      ret = writeFile(devicePath + "/power/control", "auto");
-      if (ret)
-        break;
-
-      ret = writeFile(devicePath + "/power/wakeup", "enabled");
-      break;
-     default:
-      ALOGI("usb interface does not support autosuspend %s", devicePath.c_str());
-
+  auto rule = usb->mClassRules.find(interfaceClass);
+  if (rule == usb->mClassRules.end()) {
+    ALOGI("usb interface does not support autosuspend %s", devicePath.c_str());
+    return NULL;
   }
 
-  return ret ? false : true;
+  return &rule->second;
 }
 
 }  // namespace implementation
@@ -1053,26 +2603,3 @@ static bool checkUsbInterfaceAutoSuspend(const std::string& devicePath,
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
-
-int main() {
-  using android::hardware::configureRpcThreadpool;
-  using android::hardware::joinRpcThreadpool;
-  using android::hardware::usb::V1_2::IUsb;
-  using android::hardware::usb::V1_2::implementation::Usb;
-
-  android::sp<IUsb> service = new Usb();
-
-  configureRpcThreadpool(1, true /*callerWillJoin*/);
-  android::status_t status = service->registerAsService();
-
-  if (status != android::OK) {
-    ALOGE("Cannot register USB HAL service");
-    return 1;
-  }
-
-  ALOGI("QTI USB HAL Ready.");
-  joinRpcThreadpool();
-  // Under normal cases, execution will not reach this line.
-  ALOGI("QTI USB HAL failed to join thread pool.");
-  return 1;
-}
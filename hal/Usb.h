@@ -4,8 +4,14 @@
 #include <android/hardware/usb/1.2/IUsb.h>
 #include <android/hardware/usb/1.2/types.h>
 #include <android/hardware/usb/1.2/IUsbCallback.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <hidl/Status.h>
 #include <utils/Log.h>
+#include "LatencyStats.h"
 
 #define UEVENT_MSG_LEN 2048
 // The type-c stack waits for 4.5 - 5.5 secs before declaring a port non-pd.
@@ -13,6 +19,50 @@
 // Having a margin of ~3 secs for the directory and other related bookeeping
 // structures created and uvent fired.
 #define PORT_TYPE_TIMEOUT 8
+// Quiet window after the last typec uevent of a burst before the port
+// status is re-read and reported, overridable via UEVENT_DEBOUNCE_PROP.
+#define UEVENT_DEBOUNCE_MS 20
+#define UEVENT_DEBOUNCE_PROP "vendor.usb.uevent_debounce_ms"
+// A continuous uevent storm is still reported at least every this many
+// quiet windows.
+#define UEVENT_DEBOUNCE_MAX_WINDOWS 5
+// Attaches a socket filter to the uevent socket that only lets through
+// uevents which the HAL may act upon. Enabled unless set to false.
+#define UEVENT_FILTER_PROP "vendor.usb.uevent_filter"
+// Number of leading bytes of a uevent searched by the socket filter.
+#define UEVENT_FILTER_SCAN_LEN 256
+// Uevents received by the worker are appended to the file this names,
+// see recordUevent().
+#define UEVENT_RECORD_PROP "vendor.usb.uevent_record"
+// First bytes of a uevent log
+#define UEVENT_LOG_MAGIC "USBUEVT1"
+// Seconds debug("replay") waits for the replay to finish before it leaves
+// it running in the background.
+#define UEVENT_REPLAY_TIMEOUT 30
+// Large enough for any of the typec attributes cached in PortAttrCache.
+#define PORT_ATTR_BUF_LEN 64
+// Highest typec port number + 1 that is tracked in Usb::mPorts.
+#define MAX_TYPEC_PORTS 8
+#define USB_HAL_THREADS_PROP "vendor.usb.hal.threads"
+#define USB_HAL_THREADS 2
+// Platform capabilities found by the first HAL instance of a boot, so that
+// restarts of the HAL do not probe sysfs again.
+#define USB_WAKEUP_CACHE_PROP "vendor.usb.hal.wakeup"
+#define CONTAMINANT_PATH_CACHE_PROP "vendor.usb.hal.contaminant_path"
+// Moisture source of port<N> is given by CONTAMINANT_PATH_PROP_PREFIX
+// "port<N>", "none" if it has none. Only port0 has one by default.
+#define CONTAMINANT_PATH_PROP_PREFIX "vendor.usb.contaminant_path."
+// Whether the driver of the contaminant status nodes calls sysfs_notify()
+// on them. Otherwise they are re-read on power_supply/usb uevents.
+#define CONTAMINANT_NOTIFY_PROP "vendor.usb.contaminant_notify"
+#define AUTOSUSPEND_RULES_PATH "/vendor/etc/usb_autosuspend.conf"
+// Gadget configuration whose power attributes are overridden while a port
+// runs in PD mode.
+#define GADGET_MAX_POWER_PATH "/config/usb_gadget/g1/configs/b.1/MaxPower"
+#define GADGET_ATTRIBUTES_PATH "/config/usb_gadget/g1/configs/b.1/bmAttributes"
+// Set while the override is applied. The gadget HAL re-applies it under an
+// flock() of MaxPower when it sets up a composition.
+#define PD_SELF_POWERED_PROP "vendor.usb.pd_self_powered"
 
 namespace android {
 namespace hardware {
@@ -36,6 +86,7 @@ using ::android::hardware::usb::V1_2::IUsbCallback;
 using ::android::hidl::base::V1_0::DebugInfo;
 using ::android::hidl::base::V1_0::IBase;
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_memory;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
@@ -43,19 +94,163 @@ using ::android::hardware::Return;
 using ::android::hardware::Void;
 using ::android::sp;
 
+/*
+ * Sysfs attributes of a typec port that are read on every port status
+ * query. The partner attributes live under /sys/class/typec/<port>-partner
+ * and are only valid while a partner is attached.
+ */
+enum PortAttr {
+    PORT_ATTR_POWER_ROLE,
+    PORT_ATTR_DATA_ROLE,
+    PORT_ATTR_PORT_TYPE,
+    PORT_ATTR_POWER_OP_MODE,
+    PORT_ATTR_PARTNER_ACCESSORY,
+    PORT_ATTR_PARTNER_PD,
+    PORT_ATTR_COUNT,
+};
+
+#define PORT_ATTR_PARTNER_FIRST PORT_ATTR_PARTNER_ACCESSORY
+
+/*
+ * Holds O_RDONLY fds of the PortAttr nodes open so that status queries
+ * only cost a pread() per attribute instead of a path walk and
+ * fopen/getline/fclose.
+ */
+struct PortAttrCache {
+    PortAttrCache();
+    ~PortAttrCache();
+    PortAttrCache(const PortAttrCache &) = delete;
+    PortAttrCache &operator=(const PortAttrCache &) = delete;
+
+    int fds[PORT_ATTR_COUNT];
+};
+
+/*
+ * Long lived state of /sys/class/typec/port<N>, kept in Usb::mPorts[N].
+ * Typec uevents update the entry of the port they belong to instead of
+ * re-enumerating /sys/class/typec.
+ */
+struct PortInfo {
+    PortInfo();
+    ~PortInfo();
+
+    // /sys/class/typec/<name> exists
+    bool present;
+    // /sys/class/typec/<name>-partner exists
+    bool connected;
+    std::string name;
+    // Last read power_operation_mode
+    std::string powerOpMode;
+    // Moisture source of this port number, empty if there is none. Resolved
+    // at startup and kept while the port is absent, like contaminant.
+    std::string contaminantPath;
+    // Contaminant presence last read from contaminantPath
+    bool contaminant;
+    PortAttrCache attrs;
+    // Status as last read from sysfs along with the result of that read
+    PortStatus status;
+    Status result;
+    // Protects connected, powerOpMode, contaminant, attrs, status and result
+    // while mPortLock is only held for reading
+    pthread_mutex_t lock;
+    // Serializes role switches on this port
+    pthread_mutex_t roleSwitchLock;
+    // Port type switch waiting for the partner to come back. Completed
+    // from the worker thread. Protected by Usb::mPartnerLock.
+    bool modeSwitchPending;
+    std::string modeSwitchPort;
+    V1_0::PortRole modeSwitchRole;
+    // latencyNowUs() the port type was written at and the switch times out
+    uint64_t modeSwitchStartUs;
+    uint64_t modeSwitchDeadlineUs;
+};
+
+// Most recent IUsbCallback interface implemented by the registered callback
+enum CallbackVersion {
+    CALLBACK_NONE,
+    CALLBACK_V1_0,
+    CALLBACK_V1_1,
+    CALLBACK_V1_2,
+};
+
+// Port status published by the worker thread. Never modified once published.
+struct PortStatusSnapshot {
+    // Incremented for every published snapshot
+    uint64_t generation;
+    // CLOCK_MONOTONIC time the snapshot was taken at
+    struct timespec timestamp;
+    // Callback version the status was built for. Only the ports vector of
+    // that version is filled in; CALLBACK_NONE uses ports_1_2.
+    CallbackVersion version;
+    Status status;
+    hidl_vec<V1_0::PortStatus> ports_1_0;
+    hidl_vec<PortStatus_1_1> ports_1_1;
+    hidl_vec<PortStatus> ports_1_2;
+};
+
+/*
+ * Power settings for a USB device, applied when it or one of its
+ * interfaces shows up. Empty values leave the attribute alone.
+ */
+struct AutoSuspendRule {
+    // power/control
+    std::string control;
+    // power/wakeup
+    std::string wakeup;
+    // power/autosuspend_delay_ms
+    std::string delayMs;
+};
+
+// Header of every uevent in a UEVENT_RECORD_PROP log
+struct __attribute__((packed)) UeventRecord {
+    uint64_t timestampUs;
+    uint32_t length;
+};
+
+/*
+ * Replay of a uevent log requested through debug(). Run on a thread of its
+ * own, which fills in the results and sets done.
+ */
+struct UeventReplay {
+    UeventReplay() : speedup(0), done(false), result(0), events(0), elapsedUs(0),
+                     handled(0), latency("replayed uevent") {}
+
+    std::string path;
+    // Recorded gaps between uevents are divided by this, 0 replays the log
+    // at full speed.
+    unsigned speedup;
+    bool done;
+    // 0 or an errno value
+    int result;
+    uint64_t events;
+    uint64_t elapsedUs;
+    // Uevents of the log acted upon by the scratch instance it was replayed
+    // into, kept apart from the live counters
+    uint64_t handled;
+    LatencyHistogram latency;
+};
+
 struct Usb : public IUsb {
     Usb();
+    // Scratch instance uevent logs are replayed into, see mDryRun. Takes
+    // what live discovered about the platform instead of probing it again.
+    explicit Usb(const Usb *live);
 
     Return<void> switchRole(const hidl_string& portName, const V1_0::PortRole& role) override;
     Return<void> setCallback(const sp<V1_0::IUsbCallback>& callback) override;
     Return<void> queryPortStatus() override;
     Return<void> enableContaminantPresenceProtection(const hidl_string &portName, bool enable) override;
     Return<void> enableContaminantPresenceDetection(const hidl_string &portName, bool enable) override;
+    Return<void> debug(const hidl_handle &handle, const hidl_vec<hidl_string> &options) override;
 
     sp<V1_0::IUsbCallback> mCallback_1_0;
-    // Protects mCallback variable
+    // mCallback_1_0 cast once at registration; NULL for older clients
+    sp<V1_1::IUsbCallback> mCallback_1_1;
+    sp<IUsbCallback> mCallback_1_2;
+    CallbackVersion mCallbackVersion;
+    // Protects mCallback variables
     pthread_mutex_t mLock;
-    // Protects roleSwitch operation
+    // Protects roleSwitch operation on ports outside of mPorts
     pthread_mutex_t mRoleSwitchLock;
     // Threads waiting for the partner to come back wait here
     pthread_cond_t mPartnerCV;
@@ -63,23 +258,93 @@ struct Usb : public IUsb {
     pthread_mutex_t mPartnerLock;
     // Variable to signal partner coming back online after type switch
     bool mPartnerUp;
-    // Variable to indicate presence or absence or contaminant
-    bool mContaminantPresence;
+    // Armed for the earliest deadline of the pending port type switches of
+    // mPorts, part of the worker's epoll set. -1 while the worker is not
+    // running. Protected by mPartnerLock.
+    int mModeSwitchTimerFd;
     // Variable to indicate presence or absence of wakeup node
     bool mIgnoreWakeup;
+    // Set once the enumerated devices have been swept for autosuspend
+    std::atomic<bool> mAutoSuspendSwept;
+    // Autosuspend rules by idVendor << 16 | idProduct, and by interface
+    // class. Loaded once at startup.
+    std::unordered_map<uint32_t, AutoSuspendRule> mDeviceRules;
+    std::unordered_map<int, AutoSuspendRule> mClassRules;
     // Configuration descriptor for MaxPower
     std::string mMaxPower;
     // Configuration descriptor for bmAttributes
     std::string mAttributes;
-    // Current power operation mode
-    std::string mPowerOpMode;
-    // Path to get the status of contaminant presence
-    std::string mContaminantStatusPath;
+    // The gadget is reported self-powered because a port is in PD mode
+    bool mSelfPowered;
+    // GADGET_MAX_POWER_PATH and GADGET_ATTRIBUTES_PATH, opened on first use
+    int mMaxPowerFd;
+    int mAttributesFd;
+    // Typec ports indexed by port number
+    struct PortInfo mPorts[MAX_TYPEC_PORTS];
+    // Whether /sys/class/typec has been enumerated into mPorts
+    bool mPortsScanned;
+    // Result of the last enumeration of /sys/class/typec
+    Status mScanStatus;
+    // Held for writing while ports are added, removed or enumerated, and for
+    // reading while the state of individual ports is accessed under their
+    // own lock. Protects mPorts, mPortsScanned and mScanStatus.
+    pthread_rwlock_t mPortLock;
+    // Bitmask of mPorts entries to re-read and report once the current
+    // uevent burst settles. Only accessed from the worker thread.
+    uint32_t mDirtyPorts;
+    // /sys/class/typec has to be re-enumerated once the burst settles.
+    // Only accessed from the worker thread.
+    bool mRescanPending;
+    // Latest port status, accessed with std::atomic_load/std::atomic_store
+    // only. Readers serve it as is without touching sysfs.
+    std::shared_ptr<const PortStatusSnapshot> mSnapshot;
+    // Serializes publishers of mSnapshot
+    pthread_mutex_t mSnapshotLock;
+    // Generation of the last published snapshot. Protected by mSnapshotLock.
+    uint64_t mSnapshotGeneration;
+    // Uevents read from the socket, so only those past the filter while it
+    // is attached, and those that were acted upon. The kernel does not count
+    // what the filter drops; detaching it with "lshal debug ... filter off"
+    // counts that in mUeventsFilterable instead.
+    std::atomic<uint64_t> mUeventsDelivered;
+    std::atomic<uint64_t> mUeventsHandled;
+    std::atomic<uint64_t> mUeventsFilterable;
+    // Whether the uevent socket filter is attached
+    std::atomic<bool> mUeventFilterAttached;
+    // Uevent socket of the worker, -1 while it is not running. Protected by
+    // mReplayLock.
+    int mUeventFd;
+    // Replay in progress, NULL if there is none. Protected by mReplayLock.
+    std::shared_ptr<struct UeventReplay> mReplay;
+    pthread_mutex_t mReplayLock;
+    // Signalled once mReplay is done
+    pthread_cond_t mReplayCV;
+    // Port type switches that timed out waiting for the partner
+    std::atomic<uint64_t> mModeSwitchTimeouts;
+    // Scratch instance uevent logs are replayed into: sysfs and configfs
+    // are only read, never written, and no callback is registered.
+    bool mDryRun;
+    // Durations reported through debug()
+    LatencyHistogram mSwitchRoleLatency;
+    // Port type written to partner back
+    LatencyHistogram mSwitchModeLatency;
+    LatencyHistogram mUeventLatency;
+    LatencyHistogram mPortStatusLatency;
 
     private:
         pthread_t mPoll;
 };
 
+// Whether msg is "<action>@<DEVPATH>" of a device behind a dwc3 xHCI, see
+// Usb.cpp. Checked against the std::regex it replaced under tests/.
+bool matchUsbUevent(const char *msg, std::string_view action, std::string_view *devpath,
+                    std::string_view *intf);
+
+// Runs the replay the way debug("replay") does, into a scratch instance
+// made from live, on the calling thread. Used by the tests under tests/ as
+// well.
+void replayUeventsDryRun(const Usb *live, struct UeventReplay *replay, int debounceMs);
+
 }  // namespace implementation
 }  // namespace V1_2
 }  // namespace usb
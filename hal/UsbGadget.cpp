@@ -20,50 +20,82 @@
 #define LOG_TAG "android.hardware.usb.gadget@1.0-service-qti"
 
 #include "UsbGadget.h"
+#include "FsRoot.h"
+#include <android-base/strings.h>
+#include <algorithm>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <hidl/HidlTransportSupport.h>
-
-constexpr int BUFFER_SIZE = 512;
+#include <inttypes.h>
+
+// Room for a burst of events with names of any length in one read().
+constexpr int BUFFER_SIZE = 16 * (sizeof(struct inotify_event) + NAME_MAX + 1);
+// Endpoint files appearing and going away. functionfs adds and removes
+// them without notifying, so these only fire on other filesystems.
+constexpr uint32_t FFS_WATCH_MASK = IN_CREATE | IN_DELETE;
+// The daemon writing its descriptors to ep0, which creates the endpoints,
+// and closing it, which removes them. Watched on ep0 alone, the endpoint
+// data transfers would trigger IN_MODIFY on a directory watch.
+constexpr uint32_t FFS_CONTROL_WATCH_MASK = IN_MODIFY | IN_CLOSE_WRITE;
+#define FFS_CONTROL_NAME "ep0"
+// Endpoints are tracked in a 64 bit mask, one bit is kept clear so that
+// the mask of all of them can be computed without overflowing.
+constexpr size_t MAX_FFS_ENDPOINTS = 63;
 constexpr int MAX_FILE_PATH_LENGTH = 256;
 constexpr int EPOLL_EVENTS = 10;
 constexpr bool DEBUG = false;
 constexpr int DISCONNECT_WAIT_US = 10000;
 
-#define GADGET_PATH "/config/usb_gadget/g1/"
-#define PULLUP_PATH GADGET_PATH "UDC"
-#define VENDOR_ID_PATH GADGET_PATH "idVendor"
-#define PRODUCT_ID_PATH GADGET_PATH "idProduct"
-#define DEVICE_CLASS_PATH GADGET_PATH "bDeviceClass"
-#define DEVICE_SUB_CLASS_PATH GADGET_PATH "bDeviceSubClass"
-#define DEVICE_PROTOCOL_PATH GADGET_PATH "bDeviceProtocol"
-#define DESC_USE_PATH GADGET_PATH "os_desc/use"
-#define OS_DESC_PATH GADGET_PATH "os_desc/b.1"
-#define CONFIG_PATH GADGET_PATH "configs/b.1/"
-#define FUNCTIONS_PATH GADGET_PATH "functions/"
+#define GADGETS_PATH "/config/usb_gadget/"
+#define PRIMARY_GADGET "g1"
+#define SECONDARY_GADGET "g2"
+// Relative to the directory of a gadget, see ConfigFs
+#define PULLUP_PATH "UDC"
+#define VENDOR_ID_PATH "idVendor"
+#define PRODUCT_ID_PATH "idProduct"
+#define DEVICE_CLASS_PATH "bDeviceClass"
+#define DEVICE_SUB_CLASS_PATH "bDeviceSubClass"
+#define DEVICE_PROTOCOL_PATH "bDeviceProtocol"
+#define DESC_USE_PATH "os_desc/use"
+#define OS_DESC_PATH "os_desc/b.1"
+#define CONFIG_PATH "configs/b.1/"
+#define FUNCTIONS_PATH "functions/"
+#define MAX_POWER_PATH CONFIG_PATH "MaxPower"
+#define ATTRIBUTES_PATH CONFIG_PATH "bmAttributes"
 #define FUNCTION_NAME "function"
-#define FUNCTION_PATH CONFIG_PATH FUNCTION_NAME
 #define ESOC_DEVICE_PATH "/sys/bus/esoc/devices"
 #define SOC_MACHINE_PATH "/sys/devices/soc0/machine"
+#define UDC_STATE_PATH_FMT "/sys/class/udc/%s/state"
 #define USB_CONTROLLER_PROP "vendor.usb.controller"
-#define RNDIS_FUNC_NAME_PROP "vendor.usb.rndis.func.name"
-#define RMNET_FUNC_NAME_PROP "vendor.usb.rmnet.func.name"
-#define RMNET_INST_NAME_PROP "vendor.usb.rmnet.inst.name"
-#define DPL_INST_NAME_PROP "vendor.usb.dpl.inst.name"
+// UDC of the secondary gadget, compositions that use it are skipped while
+// it is not set.
+#define SECONDARY_CONTROLLER_PROP "persist.vendor.usb.controller.secondary"
 #define PERSIST_VENDOR_USB_PROP "persist.vendor.usb.config"
-
-enum mdmType {
-  INTERNAL,
-  EXTERNAL,
-  INTERNAL_EXTERNAL,
-  NONE,
-};
+#define COMPOSITIONS_PATH "/vendor/etc/usb_compositions.conf"
+#define FFS_STAGED_PROP "vendor.usb.ffs.staged"
+// One snapshot per gadget, named after it
+#define SNAPSHOT_DIR "/data/vendor/usb/"
+#define SNAPSHOT_MAGIC "USBGSNP3"
+// Absolute attribute paths a snapshot may write, see compilePlan()
+#define MODULE_PARAMETERS_PATH "/sys/module/"
+// Attribute profile of the composition table to apply, DEFAULT_PROFILE if
+// not set.
+#define FUNCTION_PROFILE_PROP "persist.vendor.usb.function_profile"
+#define DEFAULT_PROFILE "default"
+// Whether the last composition is brought back at boot, see restoreSnapshot()
+#define SNAPSHOT_PROP "vendor.usb.gadget.boot_snapshot"
+// Set by the USB HAL while a port in PD mode has the gadget report itself
+// self-powered, see applySelfPowered().
+#define PD_SELF_POWERED_PROP "vendor.usb.pd_self_powered"
 
 namespace android {
 namespace hardware {
@@ -72,8 +104,6 @@ namespace gadget {
 namespace V1_0 {
 namespace implementation {
 
-volatile bool gadgetPullup;
-
 // Used for debug.
 static void displayInotifyEvent(struct inotify_event *i) {
   ALOGE("    wd =%2d; ", i->wd);
@@ -101,36 +131,59 @@ static void displayInotifyEvent(struct inotify_event *i) {
   if (i->len > 0) ALOGE("        name = %s\n", i->name);
 }
 
-static void *monitorFfs(void *param) {
-  UsbGadget *usbGadget = (UsbGadget *)param;
-  char buf[BUFFER_SIZE];
-  bool writeUdc = true, stopMonitor = false;
-  struct epoll_event events[EPOLL_EVENTS];
-  std::string gadgetName = GetProperty(USB_CONTROLLER_PROP, "");
+// Bitmask with a bit for each of count endpoints, count is at most
+// MAX_FFS_ENDPOINTS.
+static uint64_t allEndpoints(size_t count) {
+  return (1ULL << count) - 1;
+}
 
-  if (gadgetName.empty()) {
-    ALOGE("UDC name not defined");
-    return NULL;
-  }
+// Bitmask of the endpoints that currently exist, none if there are more
+// than can be tracked.
+static uint64_t presentEndpoints(const vector<string> &endpoints) {
+  uint64_t present = 0;
 
-  bool descriptorWritten = true;
-  for (int i = 0; i < static_cast<int>(usbGadget->mEndpointList.size()); i++) {
-    if (access(usbGadget->mEndpointList.at(i).c_str(), R_OK)) {
-      descriptorWritten = false;
-      break;
-    }
+  if (endpoints.size() > MAX_FFS_ENDPOINTS) {
+    ALOGE("%zu endpoints, at most %zu can be tracked", endpoints.size(), MAX_FFS_ENDPOINTS);
+    return 0;
   }
 
-  // notify here if the endpoints are already present.
-  if (descriptorWritten && !!WriteStringToFile(gadgetName, PULLUP_PATH)) {
-    lock_guard<mutex> lock(usbGadget->mLock);
-    usbGadget->mCurrentUsbFunctionsApplied = true;
-    gadgetPullup = true;
-    usbGadget->mCv.notify_all();
+  for (size_t i = 0; i < endpoints.size(); i++) {
+    if (!access(fsPath(endpoints[i]).c_str(), R_OK))
+      present |= 1ULL << i;
+    else if (DEBUG)
+      ALOGI("%s absent", endpoints[i].c_str());
   }
 
+  return present;
+}
+
+static bool endpointsPresent(const vector<string> &endpoints) {
+  return endpoints.size() <= MAX_FFS_ENDPOINTS &&
+         presentEndpoints(endpoints) == allEndpoints(endpoints.size());
+}
+
+bool Gadget::pullUp(const std::string &udc) {
+  ScopedLatency latency(&mHal->mPullupLatency);
+  return !mConfigFs.write(PULLUP_PATH, udc);
+}
+
+static void *monitorFfs(void *param) {
+  Gadget *gadget = (Gadget *)param;
+  char buf[BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool armed = false, writeUdc = true, stopMonitor = false;
+  struct epoll_event events[EPOLL_EVENTS];
+  // Armed endpoints as watch descriptor of their directory and file name,
+  // and watch descriptor of the ep0 next to them
+  vector<int> watches;
+  vector<string> names;
+  vector<int> controls;
+  vector<string> endpoints;
+  uint64_t present = 0, required = 0;
+  uint64_t armedUs = 0;
+  std::string gadgetName;
+
   while (!stopMonitor) {
-    int nrEvents = epoll_wait(usbGadget->mEpollFd, events, EPOLL_EVENTS, -1);
+    int nrEvents = epoll_wait(gadget->mEpollFd, events, EPOLL_EVENTS, -1);
     if (nrEvents <= 0) {
       ALOGE("epoll wait did not return descriptor number");
       continue;
@@ -139,94 +192,444 @@ static void *monitorFfs(void *param) {
     for (int i = 0; i < nrEvents; i++) {
       ALOGI("event=%u on fd=%d\n", events[i].events, events[i].data.fd);
 
-      if (events[i].data.fd == usbGadget->mInotifyFd) {
+      if (events[i].data.fd == gadget->mInotifyFd) {
+        uint64_t before = present;
+
         // Process all of the events in buffer returned by read().
-        int numRead = read(usbGadget->mInotifyFd, buf, BUFFER_SIZE);
+        int numRead = read(gadget->mInotifyFd, buf, BUFFER_SIZE);
         for (char *p = buf; p < buf + numRead;) {
           struct inotify_event *event = (struct inotify_event *)p;
           if (DEBUG) displayInotifyEvent(event);
 
           p += sizeof(struct inotify_event) + event->len;
 
-          bool descriptorPresent = true;
-          for (int j = 0; j < static_cast<int>(usbGadget->mEndpointList.size());
-               j++) {
-            if (access(usbGadget->mEndpointList.at(j).c_str(), R_OK)) {
-              if (DEBUG)
-                ALOGI("%s absent", usbGadget->mEndpointList.at(j).c_str());
-              descriptorPresent = false;
-              break;
-            }
+          // The directory or ep0 went away, it has to be watched again.
+          if (event->mask & IN_IGNORED) {
+            lock_guard<mutex> lock(gadget->mMonitorLock);
+            gadget->mWatches.erase(event->wd);
           }
 
-          if (!descriptorPresent && !writeUdc) {
-            if (DEBUG) ALOGI("endpoints not up");
-            writeUdc = true;
-          } else if (descriptorPresent && writeUdc &&
-                     !!WriteStringToFile(gadgetName, PULLUP_PATH)) {
-            lock_guard<mutex> lock(usbGadget->mLock);
-            usbGadget->mCurrentUsbFunctionsApplied = true;
-            ALOGI("GADGET pulled up");
-            writeUdc = false;
-            gadgetPullup = true;
-            // notify the main thread to signal userspace.
-            usbGadget->mCv.notify_all();
+          for (size_t j = 0; j < watches.size(); j++) {
+            uint64_t bit = 1ULL << j;
+
+            if (controls[j] == event->wd) {
+              // Descriptors written, only endpoints still missing can have
+              // shown up. On close the daemon may have gone, check them all.
+              if (((event->mask & IN_MODIFY) && !(present & bit)) ||
+                  (event->mask & IN_CLOSE_WRITE))
+                present = access(fsPath(endpoints[j]).c_str(), R_OK) ? present & ~bit
+                                                                     : present | bit;
+              else if (event->mask & IN_IGNORED)
+                present &= ~bit;
+              continue;
+            }
+
+            if (watches[j] != event->wd)
+              continue;
+
+            if (event->mask & IN_IGNORED)
+              present &= ~bit;
+            else if (event->len && names[j] == event->name)
+              present = (event->mask & IN_CREATE) ? present | bit : present & ~bit;
           }
         }
+
+        if (!armed || present == before)
+          continue;
+
+        if (present != required && !writeUdc) {
+          if (DEBUG) ALOGI("endpoints not up");
+          writeUdc = true;
+        } else if (present == required && writeUdc && gadget->pullUp(gadgetName)) {
+          gadget->mHal->mFfsWaitLatency.record(latencyNowUs() - armedUs);
+          lock_guard<mutex> lock(gadget->mLock);
+          gadget->mFunctionsApplied = true;
+          ALOGI("%s pulled up", gadget->mName.c_str());
+          writeUdc = false;
+          gadget->mPulledUp = true;
+          // notify the main thread to signal userspace.
+          gadget->mCv.notify_all();
+        }
       } else {
-        uint64_t flag;
-        read(usbGadget->mEventFd, &flag, sizeof(flag));
-        if (flag == 100) {
-          stopMonitor = true;
-          break;
+        std::deque<MonitorCommand> commands;
+        uint64_t count;
+
+        read(gadget->mEventFd, &count, sizeof(count));
+        {
+          lock_guard<mutex> lock(gadget->mMonitorLock);
+          commands.swap(gadget->mMonitorCommands);
+        }
+
+        for (MonitorCommand &command : commands) {
+          switch (command.type) {
+            case MONITOR_ARM:
+              watches = move(command.watches);
+              controls = move(command.controls);
+              endpoints = command.endpoints;
+              names.clear();
+              for (const std::string &endpoint : command.endpoints)
+                names.push_back(endpoint.substr(endpoint.rfind('/') + 1));
+              // armMonitor() does not send more than can be tracked.
+              required = allEndpoints(command.endpoints.size());
+              // Events that came in while disarmed were not tracked.
+              present = presentEndpoints(command.endpoints);
+
+              gadgetName = command.udc;
+              if (gadgetName.empty()) {
+                ALOGE("UDC name not defined");
+                armed = false;
+                break;
+              }
+
+              armed = true;
+              writeUdc = true;
+              armedUs = latencyNowUs();
+              // notify here if the endpoints are already present.
+              if (present == required && gadget->pullUp(gadgetName)) {
+                gadget->mHal->mFfsWaitLatency.record(0);
+                lock_guard<mutex> lock(gadget->mLock);
+                gadget->mFunctionsApplied = true;
+                writeUdc = false;
+                gadget->mPulledUp = true;
+                gadget->mCv.notify_all();
+              }
+              break;
+            case MONITOR_DISARM:
+              armed = false;
+              break;
+            case MONITOR_SHUTDOWN:
+              stopMonitor = true;
+              break;
+          }
+        }
+
+        {
+          lock_guard<mutex> lock(gadget->mMonitorLock);
+          gadget->mMonitorCommandsDone += commands.size();
         }
+        gadget->mMonitorCv.notify_all();
       }
     }
   }
   return NULL;
 }
 
+static int addEpollFd(const unique_fd &epfd, const unique_fd &fd) {
+  struct epoll_event event;
+  int ret;
+
+  event.data.fd = fd;
+  event.events = EPOLLIN;
+
+  ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+  if (ret) ALOGE("epoll_ctl error %d", errno);
+
+  return ret;
+}
+
+static enum mdmType getModemType();
+static bool externalModemPresent();
+static bool loadSnapshot(const std::string &path, GadgetSnapshot *snapshot,
+                         std::string *encoded);
+void *functionsWorker(void *param);
+
+#define DIAG_FUNC "${vendor.usb.diag.func.name:-diag}"
+#define RNDIS_FUNC "${vendor.usb.rndis.func.name}.rndis"
+#define RMNET_FUNC "${vendor.usb.rmnet.func.name}.${vendor.usb.rmnet.inst.name:-rmnet}"
+#define DPL_FUNC "${vendor.usb.rmnet.func.name}.${vendor.usb.dpl.inst.name:-dpl}"
+#define FFS_MTP_COND "vendor.usb.use_ffs_mtp=1"
+#define NCM_COND "persist.vendor.usb.tether.func=ncm"
+#define GSI_PARAM MODULE_PARAMETERS_PATH "usb_f_gsi/parameters/"
+
+/*
+ * Compositions for the GadgetFunction combinations the framework asks
+ * for, used after the ones of COMPOSITIONS_PATH. A plain adb request is
+ * turned into the QTI default composition of the modem type unless
+ * persist.vendor.usb.config names a vendor composition. Tethering uses NCM
+ * instead of RNDIS when persist.vendor.usb.tether.func is ncm.
+ *
+ * The high_throughput profile raises the request queue multiplier of the
+ * u_ether functions from the kernel default of 5. RNDIS is gsi.rndis on
+ * most QTI targets, whose data path is not u_ether: for it and gsi.rmnet
+ * the profile doubles the usb_f_gsi request buffers and raises the IN
+ * aggregation size, which 0 leaves to the driver's per protocol default.
+ * The default profile puts back the msm kernel defaults. Neither
+ * rndis.rndis nor ncm.0 have aggregation attributes upstream, NCM always
+ * aggregates and RNDIS takes the packets per transfer from the host, so
+ * only qmult is set for them.
+ */
+static const char defaultCompositions[] =
+    "gadget adb modem=esoc 0x05c6 0x90e5 " DIAG_FUNC ".diag " DIAG_FUNC ".diag_mdm "
+        "qdss.qdss qdss.qdss_mdm cser.dun.0 " DPL_FUNC " " RMNET_FUNC " ffs.adb\n"
+    "gadget adb modem=none 0x05c6 0x901d " DIAG_FUNC ".diag ffs.adb\n"
+    "gadget adb * 0x05c6 0x90db " DIAG_FUNC ".diag cser.dun.0 " RMNET_FUNC " " DPL_FUNC
+        " qdss.qdss ffs.adb\n"
+    "gadget mtp " FFS_MTP_COND " 0x18d1 0x4ee1 ffs.mtp\n"
+    "gadget mtp * 0x18d1 0x4ee1 mtp.gs0\n"
+    "gadget mtp,adb " FFS_MTP_COND " 0x18d1 0x4ee2 ffs.mtp ffs.adb\n"
+    "gadget mtp,adb * 0x18d1 0x4ee2 mtp.gs0 ffs.adb\n"
+    "gadget rndis " NCM_COND " 0x18d1 0x4eeb ncm.0\n"
+    "gadget rndis * 0x18d1 0x4ee3 " RNDIS_FUNC "\n"
+    "gadget rndis,adb " NCM_COND " 0x18d1 0x4eec ncm.0 ffs.adb\n"
+    "gadget rndis,adb modem=esoc 0x05c6 0x90e7 " RNDIS_FUNC " " DIAG_FUNC ".diag "
+        DIAG_FUNC ".diag_mdm qdss.qdss qdss.qdss_mdm cser.dun.0 " DPL_FUNC " ffs.adb\n"
+    "gadget rndis,adb modem=internal 0x05c6 0x90e9 " RNDIS_FUNC " " DIAG_FUNC ".diag "
+        "qdss.qdss cser.dun.0 " DPL_FUNC " ffs.adb\n"
+    "gadget rndis,adb * 0x18d1 0x4ee4 " RNDIS_FUNC " ffs.adb\n"
+    "gadget ptp " FFS_MTP_COND " 0x18d1 0x4ee5 ffs.ptp\n"
+    "gadget ptp * 0x18d1 0x4ee5 ptp.gs1\n"
+    "gadget ptp,adb " FFS_MTP_COND " 0x18d1 0x4ee6 ffs.ptp ffs.adb\n"
+    "gadget ptp,adb * 0x18d1 0x4ee6 ptp.gs1 ffs.adb\n"
+    "gadget midi * 0x18d1 0x4ee8 midi.gs5\n"
+    "gadget midi,adb * 0x18d1 0x4ee9 midi.gs5 ffs.adb\n"
+    "gadget accessory * 0x18d1 0x2d00 accessory.gs2\n"
+    "gadget accessory,adb * 0x18d1 0x2d01 accessory.gs2 ffs.adb\n"
+    "gadget audio_source * 0x18d1 0x2d02 audio_source.gs3\n"
+    "gadget audio_source,adb * 0x18d1 0x2d03 audio_source.gs3 ffs.adb\n"
+    "gadget accessory,audio_source * 0x18d1 0x2d04 accessory.gs2 audio_source.gs3\n"
+    "gadget accessory,audio_source,adb * 0x18d1 0x2d05 accessory.gs2 audio_source.gs3 "
+        "ffs.adb\n"
+    "attribute " DEFAULT_PROFILE " rndis.rndis qmult 5\n"
+    "attribute " DEFAULT_PROFILE " ncm.0 qmult 5\n"
+    "attribute " DEFAULT_PROFILE " gsi.rndis " GSI_PARAM "num_in_bufs 15\n"
+    "attribute " DEFAULT_PROFILE " gsi.rndis " GSI_PARAM "num_out_bufs 14\n"
+    "attribute " DEFAULT_PROFILE " gsi.rndis " GSI_PARAM "gsi_in_aggr_size 0\n"
+    "attribute " DEFAULT_PROFILE " gsi.rmnet " GSI_PARAM "num_in_bufs 15\n"
+    "attribute " DEFAULT_PROFILE " gsi.rmnet " GSI_PARAM "num_out_bufs 14\n"
+    "attribute " DEFAULT_PROFILE " gsi.rmnet " GSI_PARAM "gsi_in_aggr_size 0\n"
+    "attribute high_throughput rndis.rndis qmult 10\n"
+    "attribute high_throughput ncm.0 qmult 10\n"
+    "attribute high_throughput gsi.rndis " GSI_PARAM "num_in_bufs 30\n"
+    "attribute high_throughput gsi.rndis " GSI_PARAM "num_out_bufs 28\n"
+    "attribute high_throughput gsi.rndis " GSI_PARAM "gsi_in_aggr_size 16384\n"
+    "attribute high_throughput gsi.rmnet " GSI_PARAM "num_in_bufs 30\n"
+    "attribute high_throughput gsi.rmnet " GSI_PARAM "num_out_bufs 28\n"
+    "attribute high_throughput gsi.rmnet " GSI_PARAM "gsi_in_aggr_size 16384\n";
+
+#undef DIAG_FUNC
+#undef RNDIS_FUNC
+#undef RMNET_FUNC
+#undef DPL_FUNC
+#undef FFS_MTP_COND
+#undef NCM_COND
+#undef GSI_PARAM
+
+Gadget::Gadget(UsbGadget *hal, const char *name, const char *controllerProp,
+               bool createFunctions)
+    : mHal(hal),
+      mName(name),
+      mControllerProp(controllerProp),
+      mCreateFunctions(createFunctions),
+      mConfigFs(std::string(GADGETS_PATH) + name + "/"),
+      mMonitorCreated(false),
+      mMonitorCommandsSent(0),
+      mMonitorCommandsDone(0),
+      mPulledUp(false),
+      mFunctionsApplied(false),
+      mConfigKnown(false),
+      mOsDesc(false),
+      mActive(false) {
+  startMonitor();
+}
+
+Gadget::~Gadget() {
+  if (mMonitorCreated) {
+    sendMonitorCommand({MONITOR_SHUTDOWN, {}}, false);
+    mMonitor->join();
+  }
+}
+
 UsbGadget::UsbGadget()
-    : mMonitorCreated(false),
-      mCurrentUsbFunctionsApplied(false) {
-  if (access(OS_DESC_PATH, R_OK) != 0)
+    : mRequestPending(false),
+      mWorkerExit(false),
+      mRequestsSuperseded(0),
+      mSetFunctionsLatency("setCurrentUsbFunctions"),
+      mTearDownLatency("tearDown"),
+      mDisconnectWaitLatency("disconnectWait"),
+      mVidPidLatency("setVidPid"),
+      mLinkLatency("linkFunctions"),
+      mFfsWaitLatency("ffsWait"),
+      mPullupLatency("pullup") {
+  if (access(fsPath(GADGETS_PATH PRIMARY_GADGET "/" OS_DESC_PATH).c_str(), R_OK) != 0)
     ALOGE("configfs setup not done yet");
+
+  mGadgets[0].reset(new Gadget(this, PRIMARY_GADGET, USB_CONTROLLER_PROP, false));
+  // init.qcom.usb.rc only creates the directory, functions are up to us.
+  if (!access(fsPath(GADGETS_PATH SECONDARY_GADGET).c_str(), F_OK))
+    mGadgets[1].reset(new Gadget(this, SECONDARY_GADGET, SECONDARY_CONTROLLER_PROP, true));
+
+  // The snapshot remembers the modem type detected on the boot that wrote
+  // it, which is what the restored composition was compiled for. Only the
+  // first esoc node is checked against it, the esoc devices are scanned
+  // again if they disagree and nothing is restored if the type changed.
+  GadgetSnapshot snapshots[MAX_GADGETS];
+  bool restore[MAX_GADGETS] = {};
+  for (size_t i = 0; i < MAX_GADGETS; i++)
+    if (mGadgets[i])
+      restore[i] = loadSnapshot(mGadgets[i]->snapshotPath(), &snapshots[i],
+                                &mGadgets[i]->mSnapshot);
+  if (restore[0] && externalModemPresent() == (snapshots[0].modemType == EXTERNAL ||
+                                               snapshots[0].modemType == INTERNAL_EXTERNAL)) {
+    mModemType = snapshots[0].modemType;
+  } else {
+    mModemType = getModemType();
+    if (restore[0] && mModemType != snapshots[0].modemType) {
+      ALOGI("modem type changed from %d, snapshots not restored", snapshots[0].modemType);
+      for (size_t i = 0; i < MAX_GADGETS; i++)
+        restore[i] = false;
+    }
+  }
+
+  std::string table;
+  if (ReadFileToString(fsPath(COMPOSITIONS_PATH), &table))
+    loadCompositions(table, COMPOSITIONS_PATH);
+  loadCompositions(defaultCompositions, "defaults");
+
+  compilePlans(readCompositionInputs());
+  for (size_t i = 0; i < MAX_GADGETS; i++)
+    if (restore[i] && !mGadgets[i]->restoreSnapshot(snapshots[i]))
+      ALOGE("Cannot restore %s", mGadgets[i]->snapshotPath().c_str());
+  mWorker = unique_ptr<thread>(new thread(functionsWorker, this));
 }
 
-static int unlinkFunctions(const char *path) {
-  DIR *config = opendir(path);
-  struct dirent *function;
-  char filepath[MAX_FILE_PATH_LENGTH];
-  int ret = 0;
+UsbGadget::~UsbGadget() {
+  {
+    lock_guard<mutex> lock(mRequestLock);
+    mWorkerExit = true;
+  }
+  mRequestCv.notify_all();
+  mWorker->join();
 
-  if (config == NULL) return -1;
+  // The monitors record into the histograms, stop them first.
+  for (auto &gadget : mGadgets)
+    gadget.reset();
+}
 
-  // d_type does not seems to be supported in /config
-  // so filtering by name.
-  while (((function = readdir(config)) != NULL)) {
-    if ((strstr(function->d_name, FUNCTION_NAME) == NULL)) continue;
-    // build the path for each file in the folder.
-    snprintf(filepath, sizeof(filepath), "%s/%s", path, function->d_name);
-    ret = remove(filepath);
-    if (ret) {
-      ALOGE("Unable  remove file %s errno:%d", filepath, errno);
-      break;
+// Starts the ffs monitor thread. It stays disarmed until a composition
+// with ffs functions is set up.
+void Gadget::startMonitor() {
+  mInotifyFd.reset(inotify_init1(IN_CLOEXEC));
+  if (mInotifyFd < 0) {
+    ALOGE("inotify init failed");
+    return;
+  }
+
+  mEventFd.reset(eventfd(0, EFD_CLOEXEC));
+  if (mEventFd == -1) {
+    ALOGE("mEventFd failed to create %d", errno);
+    return;
+  }
+
+  mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (mEpollFd == -1) {
+    ALOGE("mEpollFd failed to create %d", errno);
+    return;
+  }
+
+  if (addEpollFd(mEpollFd, mInotifyFd) == -1) return;
+
+  if (addEpollFd(mEpollFd, mEventFd) == -1) return;
+
+  // Monitors the ffs paths to pull up the gadget when descriptors are written.
+  // Also takes of the pulling up the gadget again if the userspace process
+  // dies and restarts.
+  mMonitor = unique_ptr<thread>(new thread(monitorFfs, this));
+  mMonitorCreated = true;
+}
+
+// Queues a command for the monitor thread, waiting for it to be processed
+// if requested. Must not wait while holding mLock.
+void Gadget::sendMonitorCommand(MonitorCommand command, bool wait) {
+  std::unique_lock<std::mutex> lk(mMonitorLock);
+  uint64_t count = 1;
+
+  mMonitorCommands.push_back(move(command));
+  uint64_t seq = ++mMonitorCommandsSent;
+  write(mEventFd, &count, sizeof(count));
+
+  if (wait)
+    mMonitorCv.wait(lk, [this, seq] { return mMonitorCommandsDone >= seq; });
+}
+
+/*
+ * Makes sure the directories of the endpoints are watched and arms the
+ * monitor with them. Caller must hold mLock.
+ */
+V1_0::Status Gadget::armMonitor(const vector<string> &endpoints, const string &udc) {
+  vector<int> watches;
+  vector<int> controls;
+
+  if (!mMonitorCreated)
+    return Status::ERROR;
+
+  if (endpoints.size() > MAX_FFS_ENDPOINTS) {
+    ALOGE("%zu endpoints, at most %zu can be tracked", endpoints.size(), MAX_FFS_ENDPOINTS);
+    return Status::ERROR;
+  }
+
+  for (const std::string &endpoint : endpoints) {
+    std::string dir = endpoint.substr(0, endpoint.rfind('/') + 1);
+    lock_guard<mutex> lock(mMonitorLock);
+    int wd = -1;
+
+    for (const auto &watch : mWatches)
+      if (watch.second == dir) wd = watch.first;
+
+    if (wd == -1) {
+      wd = inotify_add_watch(mInotifyFd, fsPath(dir).c_str(), FFS_WATCH_MASK);
+      if (wd == -1) {
+        ALOGE("Cannot watch %s errno:%d", dir.c_str(), errno);
+        return Status::ERROR;
+      }
+      mWatches[wd] = dir;
+    }
+    watches.push_back(wd);
+
+    // Without ep0 the instance is not mounted yet, the directory watch is
+    // all there is to go by.
+    std::string control = dir + FFS_CONTROL_NAME;
+    wd = -1;
+    for (const auto &watch : mWatches)
+      if (watch.second == control) wd = watch.first;
+
+    if (wd == -1) {
+      wd = inotify_add_watch(mInotifyFd, fsPath(control).c_str(), FFS_CONTROL_WATCH_MASK);
+      if (wd == -1)
+        ALOGI("Cannot watch %s errno:%d", control.c_str(), errno);
+      else
+        mWatches[wd] = control;
     }
+    controls.push_back(wd);
   }
 
-  closedir(config);
-  return ret;
+  mEndpointList = endpoints;
+  sendMonitorCommand({MONITOR_ARM, endpoints, move(watches), udc, move(controls)}, false);
+  return Status::SUCCESS;
 }
 
-static int addEpollFd(const unique_fd &epfd, const unique_fd &fd) {
-  struct epoll_event event;
-  int ret;
+// Makes sure the monitor does not pull the gadget up anymore.
+void Gadget::disarmMonitor() {
+  if (mEndpointList.empty())
+    return;
 
-  event.data.fd = fd;
-  event.events = EPOLLIN;
+  sendMonitorCommand({MONITOR_DISARM, {}}, true);
+  mEndpointList.clear();
+  ALOGI("%s monitor disarmed", mName.c_str());
+}
 
-  ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
-  if (ret) ALOGE("epoll_ctl error %d", errno);
+static int unlinkFunctions(ConfigFs *configFs) {
+  vector<string> names;
+  int ret = configFs->listConfig(&names);
+
+  if (ret) return ret;
+
+  // d_type does not seems to be supported in /config
+  // so filtering by name.
+  for (const std::string &name : names) {
+    if (name.find(FUNCTION_NAME) == std::string::npos) continue;
+    ret = configFs->unlink(name);
+    if (ret) break;
+  }
 
   return ret;
 }
@@ -234,7 +637,7 @@ static int addEpollFd(const unique_fd &epfd, const unique_fd &fd) {
 Return<void> UsbGadget::getCurrentUsbFunctions(
     const sp<V1_0::IUsbGadgetCallback> &callback) {
   Return<void> ret = callback->getCurrentUsbFunctionsCb(
-      mCurrentUsbFunctions, mCurrentUsbFunctionsApplied
+      mCurrentUsbFunctions, mGadgets[0]->mFunctionsApplied
                                 ? Status::FUNCTIONS_APPLIED
                                 : Status::FUNCTIONS_NOT_APPLIED);
   if (!ret.isOk())
@@ -244,122 +647,175 @@ Return<void> UsbGadget::getCurrentUsbFunctions(
   return Void();
 }
 
-V1_0::Status UsbGadget::tearDownGadget() {
-  ALOGI("setCurrentUsbFunctions None");
+Return<void> UsbGadget::debug(const hidl_handle &handle, const hidl_vec<hidl_string> &) {
+  if (handle == nullptr || handle->numFds < 1) {
+    ALOGE("debug: invalid handle");
+    return Void();
+  }
 
-  if (!WriteStringToFile("none", PULLUP_PATH))
-    ALOGI("Gadget cannot be pulled down");
+  int fd = handle->data[0];
 
-  if (!WriteStringToFile("0", DEVICE_CLASS_PATH)) return Status::ERROR;
+  dprintf(fd, "current functions: %#" PRIx64 " %s\n", mCurrentUsbFunctions.load(),
+          mGadgets[0]->mFunctionsApplied ? "applied" : "not applied");
+  dprintf(fd, "requests superseded: %" PRIu64 "\n", mRequestsSuperseded.load());
+  for (const auto &gadget : mGadgets)
+    if (gadget) gadget->dump(fd);
 
-  if (!WriteStringToFile("0", DEVICE_SUB_CLASS_PATH)) return Status::ERROR;
+  mSetFunctionsLatency.dump(fd);
+  mTearDownLatency.dump(fd);
+  mDisconnectWaitLatency.dump(fd);
+  mVidPidLatency.dump(fd);
+  mLinkLatency.dump(fd);
+  mFfsWaitLatency.dump(fd);
+  mPullupLatency.dump(fd);
 
-  if (!WriteStringToFile("0", DEVICE_PROTOCOL_PATH)) return Status::ERROR;
+  return Void();
+}
 
-  if (!WriteStringToFile("0", DESC_USE_PATH)) return Status::ERROR;
+// Not synchronized with the worker, good enough for a dump.
+void Gadget::dump(int fd) {
+  dprintf(fd, "%s: udc %s, %s, %zu functions linked%s\n", mName.c_str(), udc().c_str(),
+          mActive ? "active" : "inactive", mLinkedFunctions.size(),
+          mFunctionsApplied ? ", pulled up" : "");
+  for (size_t i = 0; i < mLinkedFunctions.size(); i++) {
+    dprintf(fd, "  " FUNCTION_NAME "%zu -> %s\n", i, mLinkedFunctions[i].c_str());
+    // What the profile asked for next to what the driver reports now.
+    for (const auto &attribute : mLinkedAttributes[i]) {
+      std::string current;
+
+      if (mConfigFs.read(attribute.first, &current)) current = "?";
+      dprintf(fd, "    %s %s (now %s)\n", attribute.first.c_str(), attribute.second.c_str(),
+              android::base::Trim(current).c_str());
+    }
+  }
+  mConfigFs.dump(fd);
+}
 
-  if (unlinkFunctions(CONFIG_PATH)) return Status::ERROR;
+V1_0::Status Gadget::tearDownGadget() {
+  ALOGI("%s torn down", mName.c_str());
 
-  if (mMonitorCreated) {
-    uint64_t flag = 100;
-    // Stop the monitor thread by writing into signal fd.
-    write(mEventFd, &flag, sizeof(flag));
-    mMonitor->join();
-    mMonitorCreated = false;
-    ALOGI("mMonitor destroyed");
-  } else {
-    ALOGI("mMonitor not running");
+  // Whatever changed configs/b.1 may have changed VID/PID as well.
+  if (!mConfigKnown) {
+    mVid.clear();
+    mPid.clear();
   }
 
-  mInotifyFd.reset(-1);
-  mEventFd.reset(-1);
-  mEpollFd.reset(-1);
-  mEndpointList.clear();
+  if (mConfigFs.write(PULLUP_PATH, "none"))
+    ALOGI("Gadget cannot be pulled down");
+  mFunctionsApplied = false;
+
+  if (mConfigFs.write(DEVICE_CLASS_PATH, "0")) return Status::ERROR;
+
+  if (mConfigFs.write(DEVICE_SUB_CLASS_PATH, "0")) return Status::ERROR;
+
+  if (mConfigFs.write(DEVICE_PROTOCOL_PATH, "0")) return Status::ERROR;
+
+  if (mConfigFs.write(DESC_USE_PATH, "0")) return Status::ERROR;
+
+  mConfigKnown = false;
+  if (unlinkFunctions(&mConfigFs)) return Status::ERROR;
+
+  mConfigKnown = true;
+  mLinkedFunctions.clear();
+  mLinkedAttributes.clear();
+  mOsDesc = false;
+  mActive = false;
+
+  disarmMonitor();
   return Status::SUCCESS;
 }
 
-static int linkFunction(const char *function, int index) {
-  char functionPath[MAX_FILE_PATH_LENGTH];
-  char link[MAX_FILE_PATH_LENGTH];
+/*
+ * Pulls the gadget down and unlinks only the functions of the current
+ * composition that the plan does not start with. *kept is set to the
+ * number of links left in place. Falls back to tearDownGadget() when the
+ * contents of configs/b.1 are not known.
+ */
+V1_0::Status Gadget::tearDownChanges(const CompositionPlan &plan, size_t *kept) {
+  size_t common = 0;
+
+  *kept = 0;
+  if (!mConfigKnown || !plan.vendorConfig.empty())
+    return tearDownGadget();
+
+  // Function order defines the interface numbers, so only a common prefix
+  // of links can stay. A function whose attributes change is linked again,
+  // most of them are only read when the function is bound.
+  while (common < mLinkedFunctions.size() && common < plan.functions.size() &&
+         mLinkedFunctions[common] == plan.functions[common] &&
+         mLinkedAttributes[common] == plan.functionAttributes[common])
+    common++;
+
+  if (mConfigFs.write(PULLUP_PATH, "none"))
+    ALOGI("Gadget cannot be pulled down");
+  mFunctionsApplied = false;
 
-  snprintf(functionPath, sizeof(functionPath), "%s%s", FUNCTIONS_PATH, function);
-  snprintf(link, sizeof(link), "%s%d", FUNCTION_PATH, index);
-  if (symlink(functionPath, link)) {
-    ALOGE("Cannot create symlink %s -> %s errno:%d", link, functionPath, errno);
-    return -1;
+  while (mLinkedFunctions.size() > common) {
+    std::string link = FUNCTION_NAME + std::to_string(mLinkedFunctions.size() - 1);
+
+    if (mConfigFs.unlink(link)) {
+      mConfigKnown = false;
+      return Status::ERROR;
+    }
+    mLinkedFunctions.pop_back();
+    mLinkedAttributes.pop_back();
   }
-  return 0;
+
+  disarmMonitor();
+
+  ALOGI("%s kept %zu of the linked functions", mName.c_str(), common);
+  *kept = common;
+  return Status::SUCCESS;
 }
 
-static V1_0::Status setVidPid(const char *vid, const char *pid) {
-  if (!WriteStringToFile(vid, VENDOR_ID_PATH)) return Status::ERROR;
+static V1_0::Status setVidPid(ConfigFs *configFs, const string &vid, const string &pid) {
+  if (configFs->write(VENDOR_ID_PATH, vid)) return Status::ERROR;
 
-  if (!WriteStringToFile(pid, PRODUCT_ID_PATH)) return Status::ERROR;
+  if (configFs->write(PRODUCT_ID_PATH, pid)) return Status::ERROR;
 
   return Status::SUCCESS;
 }
 
-static V1_0::Status validateAndSetVidPid(uint64_t functions) {
-  V1_0::Status ret = Status::SUCCESS;
-  switch (functions) {
-    case static_cast<uint64_t>(GadgetFunction::ADB):
-      ret = setVidPid("0x18d1", "0x4ee7");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::MTP):
-      ret = setVidPid("0x18d1", "0x4ee1");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::MTP:
-      ret = setVidPid("0x18d1", "0x4ee2");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::RNDIS):
-      ret = setVidPid("0x18d1", "0x4ee3");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::RNDIS:
-      ret = setVidPid("0x18d1", "0x4ee4");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::PTP):
-      ret = setVidPid("0x18d1", "0x4ee5");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::PTP:
-      ret = setVidPid("0x18d1", "0x4ee6");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::MIDI):
-      ret = setVidPid("0x18d1", "0x4ee8");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::MIDI:
-      ret = setVidPid("0x18d1", "0x4ee9");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::ACCESSORY):
-      ret = setVidPid("0x18d1", "0x2d00");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::ACCESSORY:
-      ret = setVidPid("0x18d1", "0x2d01");
-      break;
-    case static_cast<uint64_t>(GadgetFunction::AUDIO_SOURCE):
-      ret = setVidPid("0x18d1", "0x2d02");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::AUDIO_SOURCE:
-      ret = setVidPid("0x18d1", "0x2d03");
-      break;
-    case GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE:
-      ret = setVidPid("0x18d1", "0x2d04");
-      break;
-    case GadgetFunction::ADB | GadgetFunction::ACCESSORY |
-	    GadgetFunction::AUDIO_SOURCE:
-      ret = setVidPid("0x18d1", "0x2d05");
-      break;
-    default:
-      ALOGE("Combination not supported");
-      ret = Status::CONFIGURATION_NOT_SUPPORTED;
-  }
-  return ret;
+// GadgetFunction names used as keys of the composition table.
+static const struct {
+  const char *name;
+  GadgetFunction function;
+} gadgetFunctionNames[] = {
+  {"adb", GadgetFunction::ADB},
+  {"mtp", GadgetFunction::MTP},
+  {"ptp", GadgetFunction::PTP},
+  {"rndis", GadgetFunction::RNDIS},
+  {"midi", GadgetFunction::MIDI},
+  {"accessory", GadgetFunction::ACCESSORY},
+  {"audio_source", GadgetFunction::AUDIO_SOURCE},
+};
+
+// FunctionFS instances mounted by init.qcom.usb.rc.
+static const struct FfsInstance ffsInstances[] = {
+  {"ffs.adb", {"/dev/usb-ffs/adb/ep1", "/dev/usb-ffs/adb/ep2"}, false},
+  {"ffs.mtp", {"/dev/usb-ffs/mtp/ep1", "/dev/usb-ffs/mtp/ep2",
+               "/dev/usb-ffs/mtp/ep3"}, false},
+  {"ffs.ptp", {"/dev/usb-ffs/ptp/ep1", "/dev/usb-ffs/ptp/ep2",
+               "/dev/usb-ffs/ptp/ep3"}, false},
+  {"ffs.diag", {"/dev/ffs-diag/ep1", "/dev/ffs-diag/ep2"}, true},
+  {"ffs.diag_mdm", {"/dev/ffs-diag-1/ep1", "/dev/ffs-diag-1/ep2"}, true},
+};
+
+// Whether the first esoc device is an external modem, the way
+// getModemType() tells.
+static bool externalModemPresent() {
+  std::string esoc_name;
+
+  return ReadFileToString(fsPath(ESOC_DEVICE_PATH "/esoc0/esoc_name"), &esoc_name) &&
+         (esoc_name.find("MDM") != std::string::npos ||
+          esoc_name.find("SDX") != std::string::npos);
 }
 
 static enum mdmType getModemType() {
   struct dirent* entry;
   enum mdmType mtype = INTERNAL;
   size_t pos_sda, pos_p, length;
-  std::unique_ptr<DIR, int(*)(DIR*)> dir(opendir(ESOC_DEVICE_PATH), closedir);
+  std::unique_ptr<DIR, int(*)(DIR*)> dir(opendir(fsPath(ESOC_DEVICE_PATH).c_str()), closedir);
   std::string esoc_name, path, soc_machine, esoc_dev_path = ESOC_DEVICE_PATH;
 
  /* On some platforms, /sys/bus/esoc/ director may not exists.*/
@@ -370,7 +826,7 @@ static enum mdmType getModemType() {
     if (entry->d_name[0] == '.')
       continue;
     path = esoc_dev_path + "/" + entry->d_name + "/esoc_name";
-    if (ReadFileToString(path, &esoc_name)) {
+    if (ReadFileToString(fsPath(path), &esoc_name)) {
       if (esoc_name.find("MDM") != std::string::npos ||
         esoc_name.find("SDX") != std::string::npos) {
         mtype = EXTERNAL;
@@ -378,7 +834,7 @@ static enum mdmType getModemType() {
       }
     }
   }
-  if (ReadFileToString(SOC_MACHINE_PATH, &soc_machine)) {
+  if (ReadFileToString(fsPath(SOC_MACHINE_PATH), &soc_machine)) {
     pos_sda = soc_machine.find("SDA");
     pos_p = soc_machine.find_last_of('P');
     length = soc_machine.length();
@@ -394,202 +850,498 @@ done:
   return mtype;
 }
 
-V1_0::Status UsbGadget::setupFunctions(
-    uint64_t functions, const sp<V1_0::IUsbGadgetCallback> &callback,
-    uint64_t timeout) {
-  std::unique_lock<std::mutex> lk(mLock);
+static bool parseModemType(const std::string &name, enum mdmType mtype, bool *match) {
+  if (name == "internal")
+    *match = mtype == INTERNAL;
+  else if (name == "external")
+    *match = mtype == EXTERNAL;
+  else if (name == "internal_external")
+    *match = mtype == INTERNAL_EXTERNAL;
+  else if (name == "esoc")
+    *match = mtype == EXTERNAL || mtype == INTERNAL_EXTERNAL;
+  else if (name == "none")
+    *match = mtype == NONE;
+  else
+    return false;
+
+  return true;
+}
 
-  unique_fd inotifyFd(inotify_init());
-  if (inotifyFd < 0) {
-    ALOGE("inotify init failed");
-    return Status::ERROR;
+// Adds the names of the properties value refers to.
+static void addPropertyReferences(const std::string &value, vector<string> *properties) {
+  for (size_t pos = value.find("${"); pos != std::string::npos;
+       pos = value.find("${", pos)) {
+    size_t end = value.find('}', pos);
+    if (end == std::string::npos)
+      break;
+
+    std::string name = value.substr(pos + 2, end - pos - 2);
+    name = name.substr(0, name.find(":-"));
+    if (std::find(properties->begin(), properties->end(), name) == properties->end())
+      properties->push_back(name);
+    pos = end + 1;
   }
+}
 
-  bool ffsEnabled = false;
-  int i = 0;
-  enum mdmType mtype;
-  std::string gadgetName = GetProperty(USB_CONTROLLER_PROP, "");
-  std::string rndisFunc = GetProperty(RNDIS_FUNC_NAME_PROP, "");
-  std::string rmnetFunc = GetProperty(RMNET_FUNC_NAME_PROP, "");
-  std::string rmnetInst = GetProperty(RMNET_INST_NAME_PROP, "");
-  std::string dplInst = GetProperty(DPL_INST_NAME_PROP, "");
-  std::string vendorProp = GetProperty(PERSIST_VENDOR_USB_PROP, "");
+static std::string expandProperties(const std::string &value,
+                                    const CompositionInputs &inputs) {
+  std::string expanded;
+  size_t pos = 0;
 
-  if (gadgetName.empty()) {
-    ALOGE("UDC name not defined");
-    return Status::ERROR;
-  }
+  for (size_t start = value.find("${"); start != std::string::npos;
+       start = value.find("${", pos)) {
+    size_t end = value.find('}', start);
+    if (end == std::string::npos)
+      break;
 
-  if (rmnetInst.empty()) {
-    ALOGE("rmnetinstance not defined");
-    rmnetInst = "rmnet";
-  }
+    std::string name = value.substr(start + 2, end - start - 2), fallback;
+    size_t sep = name.find(":-");
+    if (sep != std::string::npos) {
+      fallback = name.substr(sep + 2);
+      name.resize(sep);
+    }
 
-  if (dplInst.empty()) {
-    ALOGE("dplinstance not defined");
-    dplInst = "dpl";
+    auto property = inputs.properties.find(name);
+    expanded += value.substr(pos, start - pos);
+    expanded += property == inputs.properties.end() || property->second.empty()
+                    ? fallback : property->second;
+    pos = end + 1;
   }
 
-  rmnetInst = rmnetFunc + "." + rmnetInst;
-  dplInst = rmnetFunc + "." + dplInst;
+  return expanded + value.substr(pos);
+}
 
-  if ((functions & GadgetFunction::MTP) != 0) {
-    ALOGI("setCurrentUsbFunctions mtp");
-    if (!WriteStringToFile("1", DESC_USE_PATH)) return Status::ERROR;
-    if (linkFunction("mtp.gs0", i++)) return Status::ERROR;
-  }
+/*
+ * Parses composition table lines of the form
+ *
+ *   gadget <GadgetFunction names> <conditions> <idVendor> <idProduct> <function>...
+ *   vendor <persist.vendor.usb.config> <conditions> <idVendor> <idProduct> <function>...
+ *
+ * where conditions is "*" or a comma separated list of modem=<type> and
+ * <property>=<value>. Entries for other modem types are dropped here, the
+ * modem does not change at runtime. The functions may be followed by
+ * "g2 <idVendor> <idProduct> <function>..." to set up the secondary gadget
+ * along with the primary one. Lines of the form
+ *
+ *   attribute <profile> <function> <attribute> <value>
+ *
+ * add to an attribute profile, see compilePlan().
+ */
+void UsbGadget::loadCompositions(const std::string &table, const char *source) {
+  vector<string> lines = android::base::Split(table, "\n");
+  size_t count = 0;
+
+  for (size_t i = 0; i < lines.size(); i++) {
+    std::string line = android::base::Trim(lines[i].substr(0, lines[i].find('#')));
+    vector<string> fields;
+    CompositionEntry entry;
+    bool match = true;
+    uint64_t functions = 0;
+
+    if (line.empty())
+      continue;
+
+    for (const std::string &field : android::base::Split(line, " \t"))
+      if (!field.empty()) fields.push_back(field);
+
+    if (fields[0] == "attribute") {
+      if (fields.size() != 5) {
+        ALOGE("%s:%zu: malformed attribute", source, i + 1);
+        continue;
+      }
+
+      mProfiles[fields[1]].push_back({fields[2], fields[3], fields[4]});
+      addPropertyReferences(fields[2], &mInputProperties);
+      addPropertyReferences(fields[4], &mInputProperties);
+      count++;
+      continue;
+    }
+
+    if (fields.size() < 6 || (fields[0] != "gadget" && fields[0] != "vendor")) {
+      ALOGE("%s:%zu: malformed composition", source, i + 1);
+      continue;
+    }
+
+    if (fields[2] != "*") {
+      for (const std::string &condition : android::base::Split(fields[2], ",")) {
+        size_t sep = condition.find('=');
+
+        if (sep == std::string::npos) {
+          match = false;
+          ALOGE("%s:%zu: bad condition %s", source, i + 1, condition.c_str());
+        } else if (condition.substr(0, sep) == "modem") {
+          bool modem;
+          if (!parseModemType(condition.substr(sep + 1), mModemType, &modem)) {
+            ALOGE("%s:%zu: unknown modem type %s", source, i + 1, condition.c_str());
+            modem = false;
+          }
+          match = match && modem;
+        } else {
+          entry.conditions.emplace_back(condition.substr(0, sep), condition.substr(sep + 1));
+          addPropertyReferences("${" + entry.conditions.back().first + "}", &mInputProperties);
+          addPropertyReferences(entry.conditions.back().second, &mInputProperties);
+        }
+      }
+    }
+
+    if (!match)
+      continue;
+
+    GadgetEntry *gadget = &entry.gadgets[0];
+    gadget->vid = fields[3];
+    gadget->pid = fields[4];
+    for (size_t j = 5; j < fields.size(); j++) {
+      if (fields[j] != SECONDARY_GADGET) {
+        gadget->functions.push_back(fields[j]);
+        addPropertyReferences(fields[j], &mInputProperties);
+        continue;
+      }
 
-  if ((functions & GadgetFunction::PTP) != 0) {
-    ALOGI("setCurrentUsbFunctions ptp");
-    if (!WriteStringToFile("1", DESC_USE_PATH)) return Status::ERROR;
-    if (linkFunction("ptp.gs1", i++)) return Status::ERROR;
+      if (gadget != &entry.gadgets[0] || fields.size() - j < 4) {
+        match = false;
+        break;
+      }
+      gadget = &entry.gadgets[1];
+      gadget->vid = fields[++j];
+      gadget->pid = fields[++j];
+    }
+
+    if (!match || entry.gadgets[0].functions.empty()) {
+      ALOGE("%s:%zu: malformed composition", source, i + 1);
+      continue;
+    }
+
+    if (fields[0] == "vendor") {
+      mVendorCompositions[fields[1]].push_back(move(entry));
+      count++;
+      continue;
+    }
+
+    for (const std::string &name : android::base::Split(fields[1], ",")) {
+      uint64_t function = 0;
+
+      for (const auto &gadgetFunction : gadgetFunctionNames)
+        if (name == gadgetFunction.name)
+          function = static_cast<uint64_t>(gadgetFunction.function);
+
+      if (!function) {
+        ALOGE("%s:%zu: unknown gadget function %s", source, i + 1, name.c_str());
+        functions = 0;
+        break;
+      }
+      functions |= function;
+    }
+
+    if (functions) {
+      mGadgetCompositions[functions].push_back(move(entry));
+      count++;
+    }
   }
 
-  if ((functions & GadgetFunction::MIDI) != 0) {
-    ALOGI("setCurrentUsbFunctions MIDI");
-    if (linkFunction("midi.gs5", i++)) return Status::ERROR;;
+  ALOGI("loaded %zu compositions and attributes from %s", count, source);
+}
+
+CompositionInputs UsbGadget::readCompositionInputs() {
+  CompositionInputs inputs;
+
+  for (const std::string &property : mInputProperties)
+    inputs.properties[property] = GetProperty(property, "");
+
+  inputs.properties[PERSIST_VENDOR_USB_PROP] = GetProperty(PERSIST_VENDOR_USB_PROP, "");
+  inputs.properties[SECONDARY_CONTROLLER_PROP] = GetProperty(SECONDARY_CONTROLLER_PROP, "");
+  inputs.properties[FUNCTION_PROFILE_PROP] = GetProperty(FUNCTION_PROFILE_PROP, "");
+  return inputs;
+}
+
+// The FunctionFS instance of a function name, NULL for kernel functions.
+static const struct FfsInstance *findFfsInstance(const std::string &function) {
+  for (const struct FfsInstance &instance : ffsInstances)
+    if (function == instance.function) return &instance;
+
+  return NULL;
+}
+
+static void addFunction(CompositionPlan *plan, const std::string &function,
+                        vector<std::pair<string, string>> attributes) {
+  const struct FfsInstance *ffs = findFfsInstance(function);
+
+  plan->links.push_back(FUNCTION_NAME + std::to_string(plan->functions.size()));
+  plan->functions.push_back(FUNCTIONS_PATH + function);
+  plan->ffs.push_back(ffs);
+  plan->functionAttributes.push_back(move(attributes));
+
+  if (function == "mtp.gs0" || function == "ptp.gs1" || function == "ffs.mtp" ||
+      function == "ffs.ptp")
+    plan->osDesc = true;
+
+  // The diag driver reports the PID to the host tools.
+  if (function == "diag.diag")
+    plan->attributes.emplace_back(FUNCTIONS_PATH "diag.diag/pid", plan->pid);
+}
+
+// The first of the entries whose conditions hold, NULL if there is none.
+// Entries that use the secondary gadget are skipped when it is not usable.
+static const CompositionEntry *selectEntry(const vector<CompositionEntry> &entries,
+                                           const CompositionInputs &inputs, bool secondary) {
+  for (const CompositionEntry &entry : entries) {
+    bool match = secondary || entry.gadgets[1].functions.empty();
+
+    for (const auto &condition : entry.conditions)
+      match = match && expandProperties("${" + condition.first + "}", inputs) ==
+                           expandProperties(condition.second, inputs);
+    if (match)
+      return &entry;
   }
 
-  if ((functions & GadgetFunction::ACCESSORY) != 0) {
-    ALOGI("setCurrentUsbFunctions Accessory");
-    if (linkFunction("accessory.gs2", i++)) return Status::ERROR;
+  return NULL;
+}
+
+/*
+ * Every function gets the attributes the profile has for it, the first
+ * line for an attribute wins. Relative attribute paths are resolved
+ * against the directory of the function, absolute ones are used as they
+ * are, for the parameters of function drivers that have no configfs
+ * attributes. A profile should reset in the default one whatever it
+ * changes, attributes keep their value when the profile is switched.
+ */
+static void compilePlan(const GadgetEntry &entry, const CompositionInputs &inputs,
+                        const vector<ProfileAttribute> &profile, CompositionPlan *plan) {
+  plan->vid = entry.vid;
+  plan->pid = entry.pid;
+
+  for (const std::string &name : entry.functions) {
+    std::string function = expandProperties(name, inputs);
+    vector<std::pair<string, string>> attributes;
+
+    for (const ProfileAttribute &attribute : profile) {
+      if (expandProperties(attribute.function, inputs) != function) continue;
+
+      std::string path = attribute.path[0] == '/'
+                             ? attribute.path : FUNCTIONS_PATH + function + "/" + attribute.path;
+      bool set = false;
+      for (const auto &other : attributes)
+        set = set || other.first == path;
+      if (!set)
+        attributes.emplace_back(path, expandProperties(attribute.value, inputs));
+    }
+
+    addFunction(plan, function, move(attributes));
   }
+}
 
-  if ((functions & GadgetFunction::AUDIO_SOURCE) != 0) {
-    ALOGI("setCurrentUsbFunctions Audio Source");
-    if (linkFunction("audio_source.gs3", i++)) return Status::ERROR;
+// Plans of each of the gadgets the entry has functions for
+static void compileEntry(const CompositionEntry &entry, const CompositionInputs &inputs,
+                         const vector<ProfileAttribute> &profile, uint64_t functions,
+                         std::map<uint64_t, CompositionPlan> *plans) {
+  for (size_t i = 0; i < MAX_GADGETS; i++) {
+    plans[i].erase(functions);
+    if (!entry.gadgets[i].functions.empty())
+      compilePlan(entry.gadgets[i], inputs, profile, &plans[i][functions]);
   }
+}
 
-  mtype = getModemType();
-  if ((functions & GadgetFunction::RNDIS) != 0) {
-    ALOGI("setCurrentUsbFunctions rndis");
-    if (linkFunction((rndisFunc + ".rndis").c_str(), i++))
-      return Status::ERROR;
-    if (functions & GadgetFunction::ADB) {
-      if (mtype == EXTERNAL || mtype == INTERNAL_EXTERNAL) {
-        ALOGI("esoc RNDIS default composition");
-        if (linkFunction("diag.diag", i++)) return Status::ERROR;
-        if (linkFunction("diag.diag_mdm", i++)) return Status::ERROR;
-        if (linkFunction("qdss.qdss", i++)) return Status::ERROR;
-        if (linkFunction("qdss.qdss_mdm", i++)) return Status::ERROR;
-        if (linkFunction("cser.dun.0", i++)) return Status::ERROR;
-        if (linkFunction(dplInst.c_str(), i++))
-          return Status::ERROR;
-        if (setVidPid("0x05c6", "0x90e7") != Status::SUCCESS)
-          return Status::ERROR;
-      } else if (mtype == INTERNAL) {
-        ALOGI("RNDIS default composition");
-        if (linkFunction("diag.diag", i++)) return Status::ERROR;
-        if (linkFunction("qdss.qdss", i++)) return Status::ERROR;
-        if (linkFunction("cser.dun.0", i++)) return Status::ERROR;
-        if (linkFunction(dplInst.c_str(), i++))
-          return Status::ERROR;
-        if (setVidPid("0x05c6", "0x90e9") != Status::SUCCESS)
-          return Status::ERROR;
-      }
-    }
+void UsbGadget::compilePlans(const CompositionInputs &inputs) {
+  const std::string &vendorProp = inputs.properties.at(PERSIST_VENDOR_USB_PROP);
+  bool secondary = mGadgets[1] && !inputs.properties.at(SECONDARY_CONTROLLER_PROP).empty();
+  std::string profileName = inputs.properties.at(FUNCTION_PROFILE_PROP);
+  uint64_t adb = static_cast<uint64_t>(GadgetFunction::ADB);
+
+  if (profileName.empty())
+    profileName = DEFAULT_PROFILE;
+  auto found = mProfiles.find(profileName);
+  const vector<ProfileAttribute> &profile =
+      found == mProfiles.end() ? vector<ProfileAttribute>() : found->second;
+  if (found == mProfiles.end())
+    ALOGE("unknown attribute profile %s", profileName.c_str());
+
+  for (auto &plans : mPlans)
+    plans.clear();
+  for (const auto &compositions : mGadgetCompositions) {
+    const CompositionEntry *entry = selectEntry(compositions.second, inputs, secondary);
+
+    if (entry)
+      compileEntry(*entry, inputs, profile, compositions.first, mPlans);
   }
 
-  /* override adb-only with additional QTI functions */
-  if (i == 0 && functions & GadgetFunction::ADB) {
-    /* vendor defined functions if any run from vendor rc file */
-    if (!vendorProp.empty()) {
-      ALOGI("enable vendor usb config composition");
-      SetProperty("vendor.usb.config", vendorProp);
-      return Status::SUCCESS;
-    }
+  /* vendor defined functions if any replace adb-only */
+  if (!vendorProp.empty() && mPlans[0].count(adb)) {
+    auto vendor = mVendorCompositions.find(vendorProp);
+    const CompositionEntry *entry = vendor == mVendorCompositions.end()
+                                        ? NULL : selectEntry(vendor->second, inputs, secondary);
 
-    if (mtype == EXTERNAL || mtype == INTERNAL_EXTERNAL) {
-      ALOGI("esoc default composition");
-      if (linkFunction("diag.diag", i++)) return Status::ERROR;
-      if (linkFunction("diag.diag_mdm", i++)) return Status::ERROR;
-      if (linkFunction("qdss.qdss", i++)) return Status::ERROR;
-      if (linkFunction("qdss.qdss_mdm", i++)) return Status::ERROR;
-      if (linkFunction("cser.dun.0", i++)) return Status::ERROR;
-      if (linkFunction(dplInst.c_str(), i++))
-        return Status::ERROR;
-      if (linkFunction(rmnetInst.c_str(), i++))
-        return Status::ERROR;
-      if (setVidPid("0x05c6", "0x90e5") != Status::SUCCESS)
-        return Status::ERROR;
-    } else if (mtype == NONE) {
-      ALOGI("enable APQ default composition");
-      if (linkFunction("diag.diag", i++)) return Status::ERROR;
-      if (setVidPid("0x05c6", "0x901d") != Status::SUCCESS)
-        return Status::ERROR;
+    if (entry) {
+      compileEntry(*entry, inputs, profile, adb, mPlans);
     } else {
-      ALOGI("enable QC default composition");
-      if (linkFunction("diag.diag", i++)) return Status::ERROR;
-      if (linkFunction("cser.dun.0", i++)) return Status::ERROR;
-      if (linkFunction(rmnetInst.c_str(), i++))
-        return Status::ERROR;
-      if (linkFunction(dplInst.c_str(), i++))
-        return Status::ERROR;
-      if (linkFunction("qdss.qdss", i++)) return Status::ERROR;
-      if (setVidPid("0x05c6", "0x90db") != Status::SUCCESS)
-        return Status::ERROR;
+      // Not in the table, run it from the vendor rc file.
+      CompositionPlan &plan = mPlans[0][adb];
+      plan.functions.clear();
+      plan.links.clear();
+      plan.ffs.clear();
+      plan.attributes.clear();
+      plan.functionAttributes.clear();
+      plan.vendorConfig = vendorProp;
+      for (size_t i = 1; i < MAX_GADGETS; i++)
+        mPlans[i].erase(adb);
     }
   }
 
-  if ((functions & GadgetFunction::ADB) != 0) {
-    ffsEnabled = true;
-    ALOGI("setCurrentUsbFunctions Adb");
-    if (inotify_add_watch(inotifyFd, "/dev/usb-ffs/adb/", IN_ALL_EVENTS) == -1)
-      return Status::ERROR;
+  mPlanInputs = inputs;
+  ALOGI("compiled %zu compositions, %zu on the secondary gadget, modem type %d, profile %s",
+        mPlans[0].size(), mPlans[1].size(), mModemType, profileName.c_str());
+}
 
-    if (linkFunction("ffs.adb", i++)) return Status::ERROR;
-    mEndpointList.push_back("/dev/usb-ffs/adb/ep1");
-    mEndpointList.push_back("/dev/usb-ffs/adb/ep2");
-    ALOGI("Service started");
+/*
+ * Returns the plan for a GadgetFunction combination, recompiling the plans
+ * first if any of the properties they depend on has changed. Returns NULL
+ * if the combination is not supported.
+ */
+const CompositionPlan *UsbGadget::getPlan(uint64_t functions) {
+  CompositionInputs inputs = readCompositionInputs();
+
+  if (!(inputs == mPlanInputs))
+    compilePlans(inputs);
+
+  auto plan = mPlans[0].find(functions);
+  if (plan == mPlans[0].end()) {
+    ALOGE("Combination not supported");
+    return NULL;
   }
 
-  // Pull up the gadget right away when there are no ffs functions.
-  if (!ffsEnabled) {
-    if (!WriteStringToFile(gadgetName, PULLUP_PATH)) return Status::ERROR;
-    mCurrentUsbFunctionsApplied = true;
-    if (callback)
-      callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS);
-    return Status::SUCCESS;
+  return &plan->second;
+}
+
+/*
+ * Keeps the PD self-powered override of the USB HAL in place for the new
+ * composition. MaxPower is flock()ed by the USB HAL while it changes the
+ * override, so the property is checked again once the lock is held.
+ */
+static void applySelfPowered(ConfigFs *configFs) {
+  if (!android::base::GetBoolProperty(PD_SELF_POWERED_PROP, false))
+    return;
+
+  unique_fd fd(configFs->open(MAX_POWER_PATH, O_RDWR));
+  if (fd < 0)
+    return;
+
+  flock(fd, LOCK_EX);
+  if (android::base::GetBoolProperty(PD_SELF_POWERED_PROP, false)) {
+    configFs->write(MAX_POWER_PATH, "0");
+    configFs->write(ATTRIBUTES_PATH, "0xc0");
   }
+  flock(fd, LOCK_UN);
+}
 
-  unique_fd eventFd(eventfd(0, 0));
-  if (eventFd == -1) {
-    ALOGE("mEventFd failed to create %d", errno);
+V1_0::Status Gadget::setupFunctions(
+    uint64_t functions, const CompositionPlan &plan, size_t kept,
+    const sp<V1_0::IUsbGadgetCallback> &callback, uint64_t timeout) {
+  std::unique_lock<std::mutex> lk(mLock);
+  auto start = std::chrono::steady_clock::now();
+
+  std::string gadgetName = udc();
+  if (gadgetName.empty()) {
+    ALOGE("UDC name not defined for %s", mName.c_str());
     return Status::ERROR;
   }
 
-  unique_fd epollFd(epoll_create(2));
-  if (epollFd == -1) {
-    ALOGE("mEpollFd failed to create %d", errno);
-    return Status::ERROR;
+  mActive = true;
+  if (plan.vid != mVid || plan.pid != mPid) {
+    ScopedLatency latency(&mHal->mVidPidLatency);
+    mVid.clear();
+    mPid.clear();
+    if (setVidPid(&mConfigFs, plan.vid, plan.pid) != Status::SUCCESS)
+      return Status::ERROR;
+    for (const auto &attribute : plan.attributes)
+      if (mConfigFs.write(attribute.first, attribute.second)) return Status::ERROR;
+    mVid = plan.vid;
+    mPid = plan.pid;
   }
 
-  if (addEpollFd(epollFd, inotifyFd) == -1) return Status::ERROR;
+  if (!plan.vendorConfig.empty()) {
+    ALOGI("enable vendor usb config composition");
+    // The vendor rc scripts take over configs/b.1 from here.
+    mConfigKnown = false;
+    SetProperty("vendor.usb.config", plan.vendorConfig);
+    return Status::SUCCESS;
+  }
 
-  if (addEpollFd(epollFd, eventFd) == -1) return Status::ERROR;
+  if (plan.osDesc != mOsDesc) {
+    if (mConfigFs.write(DESC_USE_PATH, plan.osDesc ? "1" : "0")) return Status::ERROR;
+    mOsDesc = plan.osDesc;
+  }
 
-  mEpollFd = move(epollFd);
-  mInotifyFd = move(inotifyFd);
-  mEventFd = move(eventFd);
-  gadgetPullup = false;
+  applySelfPowered(&mConfigFs);
 
-  // Monitors the ffs paths to pull up the gadget when descriptors are written.
-  // Also takes of the pulling up the gadget again if the userspace process
-  // dies and restarts.
-  mMonitor = unique_ptr<thread>(new thread(monitorFfs, this));
-  mMonitorCreated = true;
-  if (DEBUG) ALOGI("Mainthread in Cv");
+  // Endpoints of all the linked ffs instances, the gadget is pulled up once
+  // every one of their daemons has written its descriptors.
+  vector<string> endpoints;
+  for (size_t i = 0; i < kept; i++)
+    if (plan.ffs[i])
+      endpoints.insert(endpoints.end(), plan.ffs[i]->endpoints.begin(),
+                       plan.ffs[i]->endpoints.end());
+
+  // In staged mode vendor instances that are not up yet are left out rather
+  // than holding back enumeration. They are linked by the next request for
+  // the composition once their daemon is running.
+  bool staged = android::base::GetBoolProperty(FFS_STAGED_PROP, false);
+
+  {
+    ScopedLatency latency(&mHal->mLinkLatency);
+
+    for (size_t i = kept; i < plan.functions.size(); i++) {
+      const struct FfsInstance *ffs = plan.ffs[i];
+      const std::string &link = plan.links[mLinkedFunctions.size()];
+
+      if (ffs && ffs->vendor && staged && !endpointsPresent(ffs->endpoints)) {
+        ALOGI("%s not ready, left out", ffs->function);
+        continue;
+      }
+
+      if (mCreateFunctions && mConfigFs.mkdir(plan.functions[i])) return Status::ERROR;
+      // Not every kernel has every attribute, a failed write only leaves
+      // the driver default in place.
+      for (const auto &attribute : plan.functionAttributes[i])
+        mConfigFs.write(attribute.first, attribute.second);
+      if (mConfigFs.link(plan.functions[i], link)) return Status::ERROR;
+      mLinkedFunctions.push_back(plan.functions[i]);
+      mLinkedAttributes.push_back(plan.functionAttributes[i]);
+      if (ffs)
+        endpoints.insert(endpoints.end(), ffs->endpoints.begin(), ffs->endpoints.end());
+    }
+  }
+
+  ALOGI("composition %#" PRIx64 " linked %zu functions on %s in %lld us", functions,
+        mLinkedFunctions.size() - kept, mName.c_str(),
+        (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+
+  // Pull up the gadget right away when there are no ffs functions.
+  if (endpoints.empty()) {
+    if (!pullUp(gadgetName)) return Status::ERROR;
+    mFunctionsApplied = true;
+    if (callback)
+      callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS);
+    return Status::SUCCESS;
+  }
+
+  mPulledUp = false;
+  V1_0::Status status = armMonitor(endpoints, gadgetName);
+  if (status != Status::SUCCESS)
+    return status;
+  ALOGI("Service started");
 
   if (callback) {
-    if (mCv.wait_for(lk, timeout * 1ms, [] { return gadgetPullup; })) {
-      ALOGI("monitorFfs signalled true");
+    // Give up early if a newer request is waiting, it will replace this
+    // composition anyway.
+    if (mCv.wait_for(lk, timeout * 1ms,
+                     [this] { return mPulledUp || mHal->mRequestPending; })) {
+      ALOGI("monitorFfs signalled %s", mPulledUp ? "true" : "superseded");
     } else {
       ALOGI("monitorFfs signalled error");
       // continue monitoring as the descriptors might be written at a later
       // point.
     }
     Return<void> ret = callback->setCurrentUsbFunctionsCb(
-        functions, gadgetPullup ? Status::SUCCESS : Status::ERROR);
+        functions, mPulledUp ? Status::SUCCESS : Status::ERROR);
     if (!ret.isOk())
       ALOGE("setCurrentUsbFunctionsCb error %s", ret.description().c_str());
   }
@@ -597,55 +1349,502 @@ V1_0::Status UsbGadget::setupFunctions(
   return Status::SUCCESS;
 }
 
+/*
+ * The snapshot is SNAPSHOT_MAGIC followed by the fields of GadgetSnapshot in
+ * order, strings prefixed with their 16 bit length and lists with their 16
+ * bit count, all in host byte order. It only ever has to be read back by the
+ * same build on the same device.
+ */
+static void putBytes(std::string *out, const void *bytes, size_t length) {
+  out->append(static_cast<const char *>(bytes), length);
+}
+
+static void putString(std::string *out, const std::string &value) {
+  uint16_t length = value.size();
+
+  putBytes(out, &length, sizeof(length));
+  out->append(value, 0, length);
+}
+
+static void putPairs(std::string *out, const vector<std::pair<string, string>> &pairs) {
+  uint16_t count = pairs.size();
+
+  putBytes(out, &count, sizeof(count));
+  for (uint16_t i = 0; i < count; i++) {
+    putString(out, pairs[i].first);
+    putString(out, pairs[i].second);
+  }
+}
+
+static std::string encodeSnapshot(const GadgetSnapshot &snapshot) {
+  std::string out(SNAPSHOT_MAGIC);
+  uint8_t modemType = snapshot.modemType;
+  uint8_t osDesc = snapshot.osDesc;
+
+  putBytes(&out, &snapshot.functions, sizeof(snapshot.functions));
+  putBytes(&out, &modemType, sizeof(modemType));
+  putBytes(&out, &osDesc, sizeof(osDesc));
+  putString(&out, snapshot.udc);
+  putString(&out, snapshot.vid);
+  putString(&out, snapshot.pid);
+  putPairs(&out, snapshot.links);
+  putPairs(&out, snapshot.attributes);
+  for (const auto &attributes : snapshot.linkAttributes)
+    putPairs(&out, attributes);
+
+  return out;
+}
+
+static bool getBytes(const std::string &in, size_t *offset, void *bytes, size_t length) {
+  if (in.size() - *offset < length) return false;
+
+  memcpy(bytes, in.data() + *offset, length);
+  *offset += length;
+  return true;
+}
+
+static bool getString(const std::string &in, size_t *offset, std::string *value) {
+  uint16_t length;
+
+  if (!getBytes(in, offset, &length, sizeof(length)) || in.size() - *offset < length)
+    return false;
+
+  value->assign(in, *offset, length);
+  *offset += length;
+  return true;
+}
+
+static bool getPairs(const std::string &in, size_t *offset,
+                     vector<std::pair<string, string>> *pairs) {
+  uint16_t count;
+
+  if (!getBytes(in, offset, &count, sizeof(count))) return false;
+
+  pairs->resize(count);
+  for (auto &pair : *pairs)
+    if (!getString(in, offset, &pair.first) || !getString(in, offset, &pair.second))
+      return false;
+
+  return true;
+}
+
+static bool decodeSnapshot(const std::string &in, GadgetSnapshot *snapshot) {
+  size_t offset = strlen(SNAPSHOT_MAGIC);
+  uint8_t modemType, osDesc;
+
+  if (in.compare(0, offset, SNAPSHOT_MAGIC) ||
+      !getBytes(in, &offset, &snapshot->functions, sizeof(snapshot->functions)) ||
+      !getBytes(in, &offset, &modemType, sizeof(modemType)) ||
+      !getBytes(in, &offset, &osDesc, sizeof(osDesc)) ||
+      !getString(in, &offset, &snapshot->udc) || !getString(in, &offset, &snapshot->vid) ||
+      !getString(in, &offset, &snapshot->pid) || !getPairs(in, &offset, &snapshot->links) ||
+      !getPairs(in, &offset, &snapshot->attributes))
+    return false;
+
+  snapshot->linkAttributes.resize(snapshot->links.size());
+  for (auto &attributes : snapshot->linkAttributes)
+    if (!getPairs(in, &offset, &attributes)) return false;
+  if (offset != in.size()) return false;
+
+  if (modemType > NONE) return false;
+  snapshot->modemType = static_cast<enum mdmType>(modemType);
+  snapshot->osDesc = osDesc;
+
+  // Only ever link functions and write attributes of this gadget.
+  for (const auto &link : snapshot->links)
+    if (link.first.compare(0, strlen(FUNCTIONS_PATH), FUNCTIONS_PATH) ||
+        link.first.find("..") != std::string::npos ||
+        link.second.compare(0, strlen(FUNCTION_NAME), FUNCTION_NAME))
+      return false;
+  for (const auto &attribute : snapshot->attributes)
+    if (attribute.first.empty() || attribute.first[0] == '/' ||
+        attribute.first.find("..") != std::string::npos)
+      return false;
+  for (const auto &attributes : snapshot->linkAttributes)
+    for (const auto &attribute : attributes)
+      if ((attribute.first.compare(0, strlen(FUNCTIONS_PATH), FUNCTIONS_PATH) &&
+           attribute.first.compare(0, strlen(MODULE_PARAMETERS_PATH), MODULE_PARAMETERS_PATH)) ||
+          attribute.first.find("..") != std::string::npos)
+        return false;
+
+  return true;
+}
+
+static bool loadSnapshot(const std::string &path, GadgetSnapshot *snapshot,
+                         std::string *encoded) {
+  if (!android::base::GetBoolProperty(SNAPSHOT_PROP, true)) return false;
+
+  if (!ReadFileToString(fsPath(path), encoded)) return false;
+
+  if (!decodeSnapshot(*encoded, snapshot)) {
+    ALOGE("Ignoring malformed %s", path.c_str());
+    encoded->clear();
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Persists what the composition just applied left in configs/b.1. Skipped
+ * when nothing changed since the last write, so switching back and forth
+ * between the same compositions does not touch /data.
+ */
+std::string Gadget::snapshotPath() const {
+  return SNAPSHOT_DIR + mName + ".snapshot";
+}
+
+void Gadget::saveSnapshot(uint64_t functions, const CompositionPlan &plan) {
+  if (!plan.vendorConfig.empty()) {
+    // Owned by the vendor rc scripts, nothing the HAL could bring back.
+    removeSnapshot();
+    return;
+  }
+
+  GadgetSnapshot snapshot;
+  snapshot.functions = functions;
+  snapshot.modemType = mHal->mModemType;
+  snapshot.udc = udc();
+  snapshot.vid = plan.vid;
+  snapshot.pid = plan.pid;
+  snapshot.osDesc = plan.osDesc;
+  snapshot.attributes = plan.attributes;
+  for (size_t i = 0; i < mLinkedFunctions.size(); i++)
+    snapshot.links.emplace_back(mLinkedFunctions[i], FUNCTION_NAME + std::to_string(i));
+  snapshot.linkAttributes = mLinkedAttributes;
+
+  std::string encoded = encodeSnapshot(snapshot);
+  if (encoded == mSnapshot) return;
+
+  // Written next to the snapshot and renamed over it, a crash or power
+  // loss leaves either the old or the new one behind.
+  std::string path = fsPath(snapshotPath());
+  std::string tmp = path + ".tmp";
+  if (!WriteStringToFile(encoded, tmp) || rename(tmp.c_str(), path.c_str())) {
+    ALOGE("Cannot write %s errno:%d", snapshotPath().c_str(), errno);
+    unlink(tmp.c_str());
+    return;
+  }
+
+  mSnapshot = move(encoded);
+}
+
+// Nothing to bring back at the next boot.
+void Gadget::removeSnapshot() {
+  if (!mSnapshot.empty() && unlink(fsPath(snapshotPath()).c_str()) && errno != ENOENT)
+    ALOGE("Cannot remove %s errno:%d", snapshotPath().c_str(), errno);
+  mSnapshot.clear();
+}
+
+/*
+ * Brings back the composition of the last boot before the framework is up
+ * to ask for it, so that adb and the vendor functions enumerate as soon as
+ * their daemons are running. Left alone when the vendor rc scripts already
+ * pulled up a gadget or the UDC changed. The framework request that follows
+ * finds the functions linked and only pulls the gadget up again.
+ */
+bool Gadget::restoreSnapshot(const GadgetSnapshot &snapshot) {
+  std::lock_guard<std::mutex> lock(mLock);
+  bool primary = this == mHal->mGadgets[0].get();
+  std::string controller = udc();
+  std::string pulledUp;
+
+  // The primary UDC may not be known yet, the secondary one is only used
+  // while it is set.
+  if (controller != snapshot.udc && (!controller.empty() || !primary)) {
+    ALOGI("UDC changed from %s to %s, snapshot not restored", snapshot.udc.c_str(),
+          controller.c_str());
+    return false;
+  }
+
+  if (!mConfigFs.read(PULLUP_PATH, &pulledUp) &&
+      !android::base::Trim(pulledUp).empty()) {
+    ALOGI("%s already pulled up, snapshot not restored", mName.c_str());
+    return false;
+  }
+
+  for (const auto &link : snapshot.links)
+    if (mConfigFs.mkdir(link.first)) return false;
+
+  if (unlinkFunctions(&mConfigFs)) return false;
+
+  if (setVidPid(&mConfigFs, snapshot.vid, snapshot.pid) != Status::SUCCESS) return false;
+  for (const auto &attribute : snapshot.attributes)
+    if (mConfigFs.write(attribute.first, attribute.second)) return false;
+  if (mConfigFs.write(DESC_USE_PATH, snapshot.osDesc ? "1" : "0")) return false;
+  applySelfPowered(&mConfigFs);
+
+  bool staged = android::base::GetBoolProperty(FFS_STAGED_PROP, false);
+  vector<string> endpoints;
+  mLinkedFunctions.clear();
+  mLinkedAttributes.clear();
+  for (size_t i = 0; i < snapshot.links.size(); i++) {
+    const auto &link = snapshot.links[i];
+    const struct FfsInstance *ffs = findFfsInstance(link.first.substr(strlen(FUNCTIONS_PATH)));
+
+    // Linked under the names plan links get, in order, or tearDownChanges()
+    // unlinks the wrong ones.
+    if (link.second != FUNCTION_NAME + std::to_string(mLinkedFunctions.size())) break;
+
+    if (ffs && ffs->vendor && staged && !endpointsPresent(ffs->endpoints)) break;
+
+    for (const auto &attribute : snapshot.linkAttributes[i])
+      mConfigFs.write(attribute.first, attribute.second);
+    if (mConfigFs.link(link.first, link.second)) {
+      unlinkFunctions(&mConfigFs);
+      mLinkedFunctions.clear();
+      mLinkedAttributes.clear();
+      return false;
+    }
+    mLinkedFunctions.push_back(link.first);
+    mLinkedAttributes.push_back(snapshot.linkAttributes[i]);
+    if (ffs)
+      endpoints.insert(endpoints.end(), ffs->endpoints.begin(), ffs->endpoints.end());
+  }
+
+  mConfigKnown = true;
+  mActive = true;
+  mVid = snapshot.vid;
+  mPid = snapshot.pid;
+  mOsDesc = snapshot.osDesc;
+  if (primary)
+    mHal->mCurrentUsbFunctions = snapshot.functions;
+  ALOGI("composition %#" PRIx64 " restored on %s with %zu functions", snapshot.functions,
+        mName.c_str(), mLinkedFunctions.size());
+
+  if (endpoints.empty()) {
+    if (!pullUp(snapshot.udc)) return false;
+    mFunctionsApplied = true;
+    return true;
+  }
+
+  mPulledUp = false;
+  return armMonitor(endpoints, snapshot.udc) == Status::SUCCESS;
+}
+
+// Whether the UDC is connected to a host. Assumes it is when the state is
+// not readable.
+static bool udcAttached(const std::string &udc) {
+  char path[MAX_FILE_PATH_LENGTH];
+  std::string state;
+
+  snprintf(path, sizeof(path), UDC_STATE_PATH_FMT, udc.c_str());
+  if (udc.empty() || !ReadFileToString(fsPath(path), &state))
+    return true;
+
+  return android::base::Trim(state) != "not attached";
+}
+
+/*
+ * Waits up to timeoutUs for the UDC to report the disconnect. The UDC core
+ * notifies sysfs pollers of state changes.
+ */
+static void waitForUdcDetach(const std::string &udc, int timeoutUs) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+  char path[MAX_FILE_PATH_LENGTH];
+  char state[32];
+
+  snprintf(path, sizeof(path), UDC_STATE_PATH_FMT, udc.c_str());
+  unique_fd fd(open(fsPath(path).c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    usleep(timeoutUs);
+    return;
+  }
+
+  while (true) {
+    ssize_t len = pread(fd, state, sizeof(state) - 1, 0);
+    if (len > 0) {
+      state[len] = '\0';
+      if (!strncmp(state, "not attached", strlen("not attached")))
+        return;
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    if (left <= 0)
+      return;
+
+    struct pollfd pfd = {fd, POLLPRI | POLLERR, 0};
+    if (poll(&pfd, 1, left) <= 0)
+      return;
+  }
+}
+
+void *functionsWorker(void *param) {
+  UsbGadget *usbGadget = (UsbGadget *)param;
+
+  while (true) {
+    FunctionsRequest request;
+    {
+      std::unique_lock<std::mutex> lk(usbGadget->mRequestLock);
+      usbGadget->mRequestCv.wait(lk, [usbGadget] {
+        return usbGadget->mRequestPending || usbGadget->mWorkerExit;
+      });
+      if (usbGadget->mWorkerExit)
+        break;
+
+      request = move(usbGadget->mRequest);
+      usbGadget->mRequestPending = false;
+    }
+
+    usbGadget->applyFunctions(request.functions, request.callback, request.timeout);
+  }
+  return NULL;
+}
+
+/*
+ * Queues the request for the worker and returns. A request still waiting
+ * to be picked up is dropped and its callback told so.
+ */
 Return<void> UsbGadget::setCurrentUsbFunctions(
     uint64_t functions, const sp<V1_0::IUsbGadgetCallback> &callback,
     uint64_t timeout) {
+  FunctionsRequest superseded;
+  bool dropped;
+
+  {
+    lock_guard<mutex> lock(mRequestLock);
+    dropped = mRequestPending;
+    if (dropped)
+      superseded = move(mRequest);
+    mRequest = {functions, callback, timeout};
+    mRequestPending = true;
+    mCurrentUsbFunctions = functions;
+    mGadgets[0]->mFunctionsApplied = false;
+  }
+  mRequestCv.notify_all();
+
+  // Wake up a request waiting for the ffs daemons. mLock is taken so that
+  // the notification cannot slip in before it starts waiting.
+  {
+    lock_guard<mutex> lock(mGadgets[0]->mLock);
+  }
+  mGadgets[0]->mCv.notify_all();
+
+  if (dropped) {
+    mRequestsSuperseded++;
+    ALOGI("functions %#" PRIx64 " superseded by %#" PRIx64, superseded.functions, functions);
+    if (superseded.callback) {
+      Return<void> ret = superseded.callback->setCurrentUsbFunctionsCb(
+          superseded.functions, Status::ERROR);
+      if (!ret.isOk())
+        ALOGE("Error while calling setCurrentUsbFunctionsCb %s",
+              ret.description().c_str());
+    }
+  }
+
+  return Void();
+}
+
+/*
+ * Applies a request to every gadget. The secondary gadget only follows
+ * requests while some composition puts functions on it, it is left to the
+ * rc scripts otherwise. Only the primary gadget reports to the callback.
+ */
+void UsbGadget::applyFunctions(uint64_t functions,
+                               const sp<V1_0::IUsbGadgetCallback> &callback,
+                               uint64_t timeout) {
   std::unique_lock<std::mutex> lk(mLockSetCurrentFunction);
+  ScopedLatency latency(&mSetFunctionsLatency);
+  const CompositionPlan *plans[MAX_GADGETS] = {};
+  size_t kept[MAX_GADGETS] = {};
+  std::string udcs[MAX_GADGETS];
+  bool attached[MAX_GADGETS] = {};
+  V1_0::Status status = Status::SUCCESS;
+
+  auto start = std::chrono::steady_clock::now();
+
+  if (functions != static_cast<uint64_t>(GadgetFunction::NONE) && getPlan(functions)) {
+    for (size_t i = 0; i < MAX_GADGETS; i++) {
+      auto plan = mPlans[i].find(functions);
+      if (plan != mPlans[i].end()) plans[i] = &plan->second;
+    }
+  }
+
+  // Unlink what is not part of the new composition and stop the monitors
+  // if they are not needed anymore.
+  for (size_t i = 0; i < MAX_GADGETS; i++) {
+    Gadget *gadget = mGadgets[i].get();
+    V1_0::Status torn;
 
-  mCurrentUsbFunctions = functions;
-  mCurrentUsbFunctionsApplied = false;
+    if (!gadget || (i && !plans[i] && !gadget->mActive))
+      continue;
 
-  // Unlink the gadget and stop the monitor if running.
-  V1_0::Status status = tearDownGadget();
+    udcs[i] = gadget->udc();
+    attached[i] = udcAttached(udcs[i]);
+    {
+      ScopedLatency tearDownLatency(&mTearDownLatency);
+      torn = plans[i] ? gadget->tearDownChanges(*plans[i], &kept[i]) : gadget->tearDownGadget();
+    }
+    if (torn != Status::SUCCESS) {
+      ALOGE("Cannot tear down %s", gadget->mName.c_str());
+      if (i == 0) status = torn;
+      plans[i] = NULL;
+    } else if (!plans[i]) {
+      // Torn down for good, the primary one too on NONE.
+      gadget->removeSnapshot();
+    }
+  }
   if (status != Status::SUCCESS) {
     goto error;
   }
 
-  // Leave the gadget pulled down to give time for the host to sense disconnect.
-  usleep(DISCONNECT_WAIT_US);
+  ALOGI("gadgets torn down in %lld us",
+        (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+
+  // Leave the gadgets pulled down to give time for the hosts to sense
+  // disconnect. Nothing to wait for without a host.
+  for (size_t i = 0; i < MAX_GADGETS; i++) {
+    if (attached[i]) {
+      ScopedLatency waitLatency(&mDisconnectWaitLatency);
+      waitForUdcDetach(udcs[i], DISCONNECT_WAIT_US);
+    }
+  }
 
   if (functions == static_cast<uint64_t>(GadgetFunction::NONE)) {
-    if (callback == NULL) return Void();
+    if (callback == NULL) return;
     Return<void> ret =
         callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS);
     if (!ret.isOk())
       ALOGE("Error while calling setCurrentUsbFunctionsCb %s",
             ret.description().c_str());
-    return Void();
+    return;
   }
 
-  status = validateAndSetVidPid(functions);
-
-  if (status != Status::SUCCESS) {
+  if (plans[0] == NULL) {
+    status = Status::CONFIGURATION_NOT_SUPPORTED;
     goto error;
   }
 
-  status = setupFunctions(functions, callback, timeout);
+  // The secondary gadget does not wait for its ffs daemons, set it up first
+  // so that it is not held up by the primary one.
+  for (size_t i = MAX_GADGETS - 1; i > 0; i--) {
+    if (!plans[i]) continue;
+    if (mGadgets[i]->setupFunctions(functions, *plans[i], kept[i], NULL, 0) != Status::SUCCESS)
+      ALOGE("Cannot set up %s", mGadgets[i]->mName.c_str());
+    else
+      mGadgets[i]->saveSnapshot(functions, *plans[i]);
+  }
+
+  status = mGadgets[0]->setupFunctions(functions, *plans[0], kept[0], callback, timeout);
   if (status != Status::SUCCESS) {
     goto error;
   }
+  mGadgets[0]->saveSnapshot(functions, *plans[0]);
 
   ALOGI("Usb Gadget setcurrent functions called successfully");
-  return Void();
+  return;
 
 error:
   ALOGI("Usb Gadget setcurrent functions failed");
-  if (callback == NULL) return Void();
+  // Whatever the failure left in configs/b.1 is not brought back at boot.
+  mGadgets[0]->removeSnapshot();
+  if (callback == NULL) return;
   Return<void> ret = callback->setCurrentUsbFunctionsCb(functions, status);
   if (!ret.isOk())
     ALOGE("Error while calling setCurrentUsbFunctionsCb %s",
           ret.description().c_str());
-  return Void();
 }
 }  // namespace implementation
 }  // namespace V1_0
@@ -653,26 +1852,3 @@ error:
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
-
-int main() {
-  using android::hardware::configureRpcThreadpool;
-  using android::hardware::joinRpcThreadpool;
-  using android::hardware::usb::gadget::V1_0::IUsbGadget;
-  using android::hardware::usb::gadget::V1_0::implementation::UsbGadget;
-
-  android::sp<IUsbGadget> service = new UsbGadget();
-
-  configureRpcThreadpool(1, true /*callerWillJoin*/);
-  android::status_t status = service->registerAsService();
-
-  if (status != android::OK) {
-    ALOGE("Cannot register USB Gadget HAL service");
-    return 1;
-  }
-
-  ALOGI("QTI USB Gadget HAL Ready.");
-  joinRpcThreadpool();
-  // Under normal cases, execution will not reach this line.
-  ALOGI("QTI USB Gadget HAL failed to join thread pool.");
-  return 1;
-}
@@ -30,9 +30,27 @@
 #include <sys/eventfd.h>
 #include <thread>
 #include <utils/Log.h>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
+#include "ConfigFs.h"
+#include "LatencyStats.h"
+
+#define GADGET_HAL_THREADS_PROP "vendor.usb.gadget.threads"
+#define GADGET_HAL_THREADS 2
+// g1 serves the framework requests, g2 is on a second controller that
+// compositions may put some of their functions on.
+#define MAX_GADGETS 2
+
+enum mdmType {
+  INTERNAL,
+  EXTERNAL,
+  INTERNAL_EXTERNAL,
+  NONE,
+};
 
 namespace android {
 namespace hardware {
@@ -48,6 +66,7 @@ using ::android::base::unique_fd;
 using ::android::base::WriteStringToFile;
 using ::android::base::ReadFileToString;
 using ::android::hardware::hidl_array;
+using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_memory;
 using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
@@ -62,23 +81,247 @@ using ::std::unique_ptr;
 using ::std::vector;
 using namespace std::chrono_literals;
 
-struct UsbGadget : public IUsbGadget {
-  UsbGadget();
+// Property values the composition plans are compiled from, by name.
+struct CompositionInputs {
+  std::map<string, string> properties;
+
+  bool operator==(const CompositionInputs &other) const {
+    return properties == other.properties;
+  }
+};
+
+// What one composition table entry puts on one of the gadgets
+struct GadgetEntry {
+  string vid;
+  string pid;
+  vector<string> functions;
+};
+
+// One line of the composition table. Function names and condition values
+// may refer to properties as ${name} or ${name:-default}, like init does.
+struct CompositionEntry {
+  // Properties that must have the given value for the entry to apply.
+  vector<std::pair<string, string>> conditions;
+  // By gadget index, the secondary gadget has no functions unless the
+  // entry names it.
+  GadgetEntry gadgets[MAX_GADGETS];
+};
+
+// One attribute line of the composition table, written before the function is
+// linked while its profile is selected.
+struct ProfileAttribute {
+  string function;
+  // Relative to the function directory, or absolute for module parameters
+  string path;
+  string value;
+};
+
+// A FunctionFS instance and the endpoints its daemon has to bring up
+// before the gadget can be pulled up.
+struct FfsInstance {
+  const char *function;
+  vector<string> endpoints;
+  // Served by a vendor daemon rather than the framework, may be left out
+  // of the composition in staged mode.
+  bool vendor;
+};
+
+// What configs/b.1 looks like for one GadgetFunction combination.
+// Compiled ahead of time so that applying it is a series of configfs
+// writes and symlinks with no lookups in between.
+struct CompositionPlan {
+  string vid;
+  string pid;
+  // os_desc/use is set
+  bool osDesc = false;
+  // Paths relative to the gadget, linked in order as function0, function1...
+  vector<string> functions;
+  vector<string> links;
+  // FunctionFS instance for each of functions, NULL for kernel functions
+  vector<const FfsInstance *> ffs;
+  // Function attributes written along with VID/PID, path relative to the
+  // gadget and value
+  vector<std::pair<string, string>> attributes;
+  // Attributes of the selected profile for each of functions, written
+  // right before it is linked.
+  vector<vector<std::pair<string, string>>> functionAttributes;
+  // Non empty if the composition is left to the vendor rc scripts
+  string vendorConfig;
+};
+
+enum MonitorCommandType {
+  // Pull the gadget up once the given endpoints are all present
+  MONITOR_ARM,
+  // Stop pulling the gadget up
+  MONITOR_DISARM,
+  MONITOR_SHUTDOWN,
+};
+
+struct MonitorCommand {
+  MonitorCommandType type;
+  vector<string> endpoints;
+  // Watch descriptors of the directories of endpoints
+  vector<int> watches;
+  // UDC to pull the gadget up on
+  string udc;
+  // Watch descriptors of the ep0 next to each of endpoints, -1 if not
+  // watched
+  vector<int> controls;
+};
+
+// configs/b.1 as last set up by the HAL, persisted so that the next boot
+// can bring it back before the framework asks for it.
+struct GadgetSnapshot {
+  uint64_t functions = 0;
+  // Platform detection of that boot
+  enum mdmType modemType = INTERNAL;
+  string udc;
+  string vid;
+  string pid;
+  bool osDesc = false;
+  // Function paths with the name they are linked as, in order
+  vector<std::pair<string, string>> links;
+  vector<std::pair<string, string>> attributes;
+  // Profile attributes of each of links
+  vector<vector<std::pair<string, string>>> linkAttributes;
+};
+
+struct FunctionsRequest {
+  uint64_t functions;
+  sp<IUsbGadgetCallback> callback;
+  uint64_t timeout;
+};
+
+struct UsbGadget;
+
+/*
+ * One gadget under /config/usb_gadget and the UDC it is pulled up on. Each
+ * has its own configfs state, FunctionFS monitor and pull-up, so that
+ * gadgets on different controllers enumerate independently of each other.
+ * Set up by the worker of the UsbGadget it belongs to.
+ */
+struct Gadget {
+  Gadget(UsbGadget *hal, const char *name, const char *controllerProp, bool createFunctions);
+  ~Gadget();
+
+  UsbGadget *const mHal;
+  // Directory name, g1 or g2
+  const string mName;
+  // Property naming the UDC
+  const char *const mControllerProp;
+  // Function instances are created by the HAL rather than init.qcom.usb.rc
+  const bool mCreateFunctions;
+  // All configfs I/O of the gadget
+  ConfigFs mConfigFs;
+
+  // Owned by the monitor thread, which lives as long as the gadget.
   unique_fd mInotifyFd;
   unique_fd mEventFd;
   unique_fd mEpollFd;
 
   unique_ptr<thread> mMonitor;
   volatile bool mMonitorCreated;
+  // Endpoints the monitor is armed with
   vector<string> mEndpointList;
+  // Protects the monitor command queue and mWatches.
+  std::mutex mMonitorLock;
+  std::condition_variable mMonitorCv;
+  std::deque<MonitorCommand> mMonitorCommands;
+  uint64_t mMonitorCommandsSent;
+  uint64_t mMonitorCommandsDone;
+  // Watched ffs directories and their ep0 by watch descriptor. Watches
+  // stay registered across compositions until the watched path goes away.
+  std::map<int, string> mWatches;
   // protects the CV.
   std::mutex mLock;
   std::condition_variable mCv;
+  // Set by the monitor once it pulled up the gadget it was armed for
+  volatile bool mPulledUp;
+  std::atomic<bool> mFunctionsApplied;
+
+  // configs/b.1 as left by the last request. Only trusted while
+  // mConfigKnown is set, the vendor rc scripts may change it behind our back.
+  bool mConfigKnown;
+  vector<string> mLinkedFunctions;
+  // Profile attributes each of mLinkedFunctions was linked with
+  vector<vector<std::pair<string, string>>> mLinkedAttributes;
+  string mVid;
+  string mPid;
+  bool mOsDesc;
+  // A composition of the HAL is set up. The secondary gadget is left to
+  // the rc scripts otherwise.
+  bool mActive;
+  // Encoded GadgetSnapshot last written or restored
+  string mSnapshot;
+
+  string udc() const { return GetProperty(mControllerProp, ""); }
+  string snapshotPath() const;
+  bool pullUp(const string &udc);
+  void startMonitor();
+  void sendMonitorCommand(MonitorCommand command, bool wait);
+  Status armMonitor(const vector<string> &endpoints, const string &udc);
+  void disarmMonitor();
+  Status tearDownGadget();
+  Status tearDownChanges(const CompositionPlan &plan, size_t *kept);
+  Status setupFunctions(uint64_t functions, const CompositionPlan &plan,
+                        size_t kept, const sp<IUsbGadgetCallback>& callback,
+                        uint64_t timeout);
+  bool restoreSnapshot(const GadgetSnapshot &snapshot);
+  void saveSnapshot(uint64_t functions, const CompositionPlan &plan);
+  void removeSnapshot();
+  void dump(int fd);
+};
+
+struct UsbGadget : public IUsbGadget {
+  UsbGadget();
+  ~UsbGadget();
 
   // Makes sure that only one request is processed at a time.
   std::mutex mLockSetCurrentFunction;
-  uint64_t mCurrentUsbFunctions;
-  bool mCurrentUsbFunctionsApplied;
+  // Read by getCurrentUsbFunctions() without mLockSetCurrentFunction so
+  // that it is not held up by a request in progress. Applied is tracked
+  // by the primary gadget.
+  std::atomic<uint64_t> mCurrentUsbFunctions;
+  // Requests are applied by the worker thread. Only the latest one that
+  // has not been picked up yet is kept, in mRequest.
+  unique_ptr<thread> mWorker;
+  std::mutex mRequestLock;
+  std::condition_variable mRequestCv;
+  std::atomic<bool> mRequestPending;
+  FunctionsRequest mRequest;
+  bool mWorkerExit;
+
+  // Read once, the modem does not change at runtime
+  enum mdmType mModemType;
+  // Composition table entries that apply to mModemType, in order of
+  // precedence. Keyed by GadgetFunction bitmask, vendor ones by their
+  // persist.vendor.usb.config value. Loaded once at startup.
+  std::map<uint64_t, vector<CompositionEntry>> mGadgetCompositions;
+  std::map<string, vector<CompositionEntry>> mVendorCompositions;
+  // Attribute profiles of the table by name
+  std::map<string, vector<ProfileAttribute>> mProfiles;
+  // Properties referred to by the table
+  vector<string> mInputProperties;
+  // Supported compositions by gadget index, keyed by GadgetFunction
+  // bitmask. The secondary gadget only has plans for the compositions that
+  // use it. Accessed with mLockSetCurrentFunction held.
+  std::map<uint64_t, CompositionPlan> mPlans[MAX_GADGETS];
+  CompositionInputs mPlanInputs;
+  // By index, the primary one always exists
+  unique_ptr<Gadget> mGadgets[MAX_GADGETS];
+
+  // Requests dropped for a newer one before the worker picked them up
+  std::atomic<uint64_t> mRequestsSuperseded;
+  // Durations reported through debug(), of all gadgets. A request on the
+  // worker is broken down into the other stages.
+  LatencyHistogram mSetFunctionsLatency;
+  LatencyHistogram mTearDownLatency;
+  LatencyHistogram mDisconnectWaitLatency;
+  LatencyHistogram mVidPidLatency;
+  LatencyHistogram mLinkLatency;
+  // Monitor armed to gadget pulled up
+  LatencyHistogram mFfsWaitLatency;
+  LatencyHistogram mPullupLatency;
 
   Return<void> setCurrentUsbFunctions(uint64_t functions,
                                       const sp<IUsbGadgetCallback>& callback,
@@ -87,11 +330,17 @@ struct UsbGadget : public IUsbGadget {
   Return<void> getCurrentUsbFunctions(
       const sp<IUsbGadgetCallback>& callback) override;
 
+  Return<void> debug(const hidl_handle &handle,
+                     const hidl_vec<hidl_string> &options) override;
+
   private:
-  Status tearDownGadget();
-  Status setupFunctions(uint64_t functions,
-                        const sp<IUsbGadgetCallback>& callback,
-                        uint64_t timeout);
+  friend void *functionsWorker(void *param);
+  void applyFunctions(uint64_t functions, const sp<IUsbGadgetCallback> &callback,
+                      uint64_t timeout);
+  void loadCompositions(const string &table, const char *source);
+  CompositionInputs readCompositionInputs();
+  void compilePlans(const CompositionInputs &inputs);
+  const CompositionPlan *getPlan(uint64_t functions);
 };
 
 }  // namespace implementation
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018-2020, The Linux Foundation. All rights reserved.
+ * Not a Contribution.
+ *
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.gadget@1.0-service-qti"
+
+#include <android-base/properties.h>
+#include <hidl/HidlTransportSupport.h>
+
+#include "UsbGadget.h"
+
+int main() {
+  using android::hardware::configureRpcThreadpool;
+  using android::hardware::joinRpcThreadpool;
+  using android::hardware::usb::gadget::V1_0::IUsbGadget;
+  using android::hardware::usb::gadget::V1_0::implementation::UsbGadget;
+
+  android::sp<IUsbGadget> service = new UsbGadget();
+
+  configureRpcThreadpool(android::base::GetUintProperty<size_t>(GADGET_HAL_THREADS_PROP,
+                                                                GADGET_HAL_THREADS),
+                         true /*callerWillJoin*/);
+  android::status_t status = service->registerAsService();
+
+  if (status != android::OK) {
+    ALOGE("Cannot register USB Gadget HAL service");
+    return 1;
+  }
+
+  ALOGI("QTI USB Gadget HAL Ready.");
+  joinRpcThreadpool();
+  // Under normal cases, execution will not reach this line.
+  ALOGI("QTI USB Gadget HAL failed to join thread pool.");
+  return 1;
+}
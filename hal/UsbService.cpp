@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019-2021, The Linux Foundation. All rights reserved.
+ * Not a Contribution.
+ *
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb@1.2-service-qti"
+
+#include <android-base/properties.h>
+#include <hidl/HidlTransportSupport.h>
+
+#include "Usb.h"
+
+int main() {
+  using android::hardware::configureRpcThreadpool;
+  using android::hardware::joinRpcThreadpool;
+  using android::hardware::usb::V1_2::IUsb;
+  using android::hardware::usb::V1_2::implementation::Usb;
+
+  android::sp<IUsb> service = new Usb();
+
+  configureRpcThreadpool(android::base::GetUintProperty<size_t>(USB_HAL_THREADS_PROP,
+                                                                USB_HAL_THREADS),
+                         true /*callerWillJoin*/);
+  android::status_t status = service->registerAsService();
+
+  if (status != android::OK) {
+    ALOGE("Cannot register USB HAL service");
+    return 1;
+  }
+
+  ALOGI("QTI USB HAL Ready.");
+  joinRpcThreadpool();
+  // Under normal cases, execution will not reach this line.
+  ALOGI("QTI USB HAL failed to join thread pool.");
+  return 1;
+}
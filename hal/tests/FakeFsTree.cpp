@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FakeFsTree.h"
+
+#include <android-base/file.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <errno.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FsRoot.h"
+#include "Usb.h"
+
+using android::base::Basename;
+using android::base::Dirname;
+using android::base::GetExecutableDirectory;
+using android::base::GetProperty;
+using android::base::ReadFileToString;
+using android::base::SetProperty;
+using android::base::Split;
+using android::base::WriteStringToFile;
+using android::hardware::usb::V1_2::implementation::UeventRecord;
+
+FakeFsTree::FakeFsTree() {
+  const char *tmp = getenv("TMPDIR");
+  std::string dir = std::string(tmp ? tmp : "/data/local/tmp") + "/usbhal.XXXXXX";
+
+  if (mkdtemp(&dir[0]) == NULL) {
+    perror("mkdtemp");
+    abort();
+  }
+  mRoot = dir;
+  setFsRoot(mRoot);
+}
+
+static int removeNode(const char *path, const struct stat *, int, struct FTW *) {
+  return ::remove(path);
+}
+
+FakeFsTree::~FakeFsTree() {
+  setFsRoot("");
+  nftw(mRoot.c_str(), removeNode, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+bool FakeFsTree::mkdirs(const std::string &path) {
+  std::string full = mRoot + path;
+
+  for (size_t pos = mRoot.size() + 1; pos != std::string::npos; ) {
+    pos = full.find('/', pos + 1);
+    if (mkdir(full.substr(0, pos).c_str(), 0770) && errno != EEXIST)
+      return false;
+  }
+
+  return true;
+}
+
+bool FakeFsTree::writeFile(const std::string &path, const std::string &contents) {
+  return mkdirs(Dirname(path)) && WriteStringToFile(contents, mRoot + path);
+}
+
+bool FakeFsTree::readFile(const std::string &path, std::string *contents) const {
+  return ReadFileToString(mRoot + path, contents);
+}
+
+bool FakeFsTree::symlink(const std::string &target, const std::string &path) {
+  return mkdirs(Dirname(path)) && !::symlink(target.c_str(), (mRoot + path).c_str());
+}
+
+bool FakeFsTree::remove(const std::string &path) {
+  return !nftw((mRoot + path).c_str(), removeNode, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+void FakeFsTree::addTypecPorts(int count, int partners) {
+  for (int i = 0; i < count; i++) {
+    std::string port = "port" + std::to_string(i);
+    std::string device = "/sys" TYPEC_DEVICE_PATH "/typec/" + port;
+
+    writeFile(device + "/power_role", "source [sink]\n");
+    writeFile(device + "/data_role", "host [device]\n");
+    writeFile(device + "/port_type", "[dual] source sink\n");
+    writeFile(device + "/power_operation_mode", "default\n");
+    symlink("../../devices" + device.substr(strlen("/sys/devices")),
+            "/sys/class/typec/" + port);
+    if (i < partners)
+      addPartner(i);
+  }
+}
+
+void FakeFsTree::addPartner(int port) {
+  std::string partner = "port" + std::to_string(port) + "-partner";
+  std::string device = "/sys" TYPEC_DEVICE_PATH "/typec/port" + std::to_string(port) + "/" +
+                       partner;
+
+  writeFile(device + "/accessory_mode", "none\n");
+  writeFile(device + "/supports_usb_power_delivery", "yes\n");
+  symlink("../../devices" + device.substr(strlen("/sys/devices")),
+          "/sys/class/typec/" + partner);
+}
+
+void FakeFsTree::removePartner(int port) {
+  std::string partner = "port" + std::to_string(port) + "-partner";
+
+  remove("/sys/class/typec/" + partner);
+  remove("/sys" TYPEC_DEVICE_PATH "/typec/port" + std::to_string(port) + "/" + partner);
+}
+
+void FakeFsTree::addGadget(const std::string &name, const std::vector<std::string> &functions) {
+  std::string gadget = "/config/usb_gadget/" + name + "/";
+
+  for (const char *attr : {"UDC", "idVendor", "idProduct", "bDeviceClass", "bDeviceSubClass",
+                           "bDeviceProtocol", "os_desc/use"})
+    writeFile(gadget + attr, "");
+  writeFile(gadget + "configs/b.1/MaxPower", "900\n");
+  writeFile(gadget + "configs/b.1/bmAttributes", "0x80\n");
+  symlink("../configs/b.1", gadget + "os_desc/b.1");
+  for (const auto &function : functions)
+    mkdirs(gadget + "functions/" + function);
+}
+
+void FakeFsTree::addFfsInstance(const std::string &dir, int endpoints) {
+  for (int i = 0; i <= endpoints; i++)
+    writeFile(dir + "/ep" + std::to_string(i), "");
+}
+
+void FakeFsTree::addUdc(const std::string &udc) {
+  writeFile("/sys/class/udc/" + udc + "/state", "not attached\n");
+}
+
+std::string FakeFsTree::addPrimaryGadget() {
+  std::string udc = GetProperty("vendor.usb.controller", "");
+
+  if (udc.empty()) {
+    udc = "a600000.dwc3";
+    SetProperty("vendor.usb.controller", udc);
+  }
+
+  addGadget("g1", {"ffs.adb", "ffs.mtp", "ffs.ptp", "mtp.gs0", "ptp.gs1", "midi.gs5",
+                   "accessory.gs2", "audio_source.gs3"});
+  addFfsInstance("/dev/usb-ffs/adb", 2);
+  addFfsInstance("/dev/usb-ffs/mtp", 3);
+  addFfsInstance("/dev/usb-ffs/ptp", 3);
+  addUdc(udc);
+  mkdirs("/data/vendor/usb");
+
+  return udc;
+}
+
+std::vector<UeventBurst> loadUeventCorpus() {
+  std::vector<UeventBurst> bursts(1);
+  std::string corpus;
+
+  if (!ReadFileToString(GetExecutableDirectory() + "/uevent_corpus.txt", &corpus))
+    return {};
+
+  for (const auto &line : Split(corpus, "\n")) {
+    if (line.empty()) {
+      if (!bursts.back().empty())
+        bursts.emplace_back();
+    } else if (line[0] != '#') {
+      bursts.back().push_back(line);
+    }
+  }
+  if (bursts.back().empty())
+    bursts.pop_back();
+
+  return bursts;
+}
+
+static std::string ueventSubsystem(const std::string &devpath) {
+  if (devpath.find("/typec/") != std::string::npos)
+    return "typec";
+  if (devpath.find("/power_supply/") != std::string::npos)
+    return "power_supply";
+  if (devpath.find("/xhci-hcd.") != std::string::npos)
+    return "usb";
+
+  return Basename(Dirname(devpath));
+}
+
+bool writeUeventLog(const std::string &path, const std::vector<UeventBurst> &bursts) {
+  std::string log = UEVENT_LOG_MAGIC;
+  uint64_t timestampUs = 1000000;
+
+  for (const auto &burst : bursts) {
+    for (const auto &uevent : burst) {
+      size_t at = uevent.find('@');
+      std::string devpath = uevent.substr(at + 1);
+      std::string subsystem = ueventSubsystem(devpath);
+      std::string msg = uevent + '\0' + "ACTION=" + uevent.substr(0, at) + '\0' +
+                        "DEVPATH=" + devpath + '\0' + "SUBSYSTEM=" + subsystem + '\0';
+
+      if (subsystem == "power_supply")
+        msg += "POWER_SUPPLY_NAME=" + Basename(devpath) + '\0';
+
+      UeventRecord record = {timestampUs, (uint32_t)msg.size()};
+      log.append((const char *)&record, sizeof(record));
+      log += msg;
+      timestampUs += 1000;
+    }
+    timestampUs += 100000;
+  }
+
+  return WriteStringToFile(log, path);
+}
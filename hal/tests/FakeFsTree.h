@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VENDOR_QCOM_USB_TESTS_FAKE_FS_TREE_H
+#define VENDOR_QCOM_USB_TESTS_FAKE_FS_TREE_H
+
+#include <string>
+#include <vector>
+
+// Where the typec class devices of addTypecPorts() live, below /sys.
+#define TYPEC_DEVICE_PATH "/devices/platform/soc/soc:qcom,pmic_glink/soc:qcom,pmic_glink:qcom,ucsi"
+
+/*
+ * Temporary directory laid out like the sysfs, configfs and devfs nodes the
+ * HALs use, installed as fsRoot() for as long as it exists. Only one may
+ * exist at a time. Regular files and directories stand in for the kernel
+ * nodes, so writes stick and nothing is ever notified by a driver.
+ */
+class FakeFsTree {
+ public:
+  FakeFsTree();
+  ~FakeFsTree();
+  FakeFsTree(const FakeFsTree &) = delete;
+  FakeFsTree &operator=(const FakeFsTree &) = delete;
+
+  const std::string &root() const { return mRoot; }
+
+  // path is absolute, as the HALs see it. Missing parents are created.
+  bool writeFile(const std::string &path, const std::string &contents);
+  bool readFile(const std::string &path, std::string *contents) const;
+  bool mkdirs(const std::string &path);
+  bool symlink(const std::string &target, const std::string &path);
+  bool remove(const std::string &path);
+
+  /*
+   * /sys/class/typec/port0 up to port<count - 1>, linked to their device
+   * under TYPEC_DEVICE_PATH like the typec class does. The first partners
+   * ports have a partner that supports PD.
+   */
+  void addTypecPorts(int count, int partners);
+  void addPartner(int port);
+  void removePartner(int port);
+
+  /*
+   * /config/usb_gadget/<name> as init.qcom.usb.rc leaves it, with a
+   * functions/ directory for each of functions and nothing linked.
+   */
+  void addGadget(const std::string &name, const std::vector<std::string> &functions);
+  // FunctionFS instance mounted at dir with ep0 and ep1 up to endpoints
+  void addFfsInstance(const std::string &dir, int endpoints);
+  // /sys/class/udc/<udc> with no host attached
+  void addUdc(const std::string &udc);
+  /*
+   * g1 with the function directories of the built-in compositions and the
+   * FunctionFS instances they use, along with the directory its snapshot
+   * is written to, and the UDC it is pulled up on. That is the one
+   * vendor.usb.controller names, which is only set if it is empty as the
+   * HAL of the device reads it as well. Returns the UDC.
+   */
+  std::string addPrimaryGadget();
+
+ private:
+  std::string mRoot;
+};
+
+// First strings of uevents, "<action>@<DEVPATH>", that arrive together
+typedef std::vector<std::string> UeventBurst;
+
+// uevent_corpus.txt as installed next to the test binary, by burst
+std::vector<UeventBurst> loadUeventCorpus();
+
+/*
+ * Writes bursts to path as a UEVENT_LOG_MAGIC log, the way recordUevent()
+ * would have recorded them: 1ms apart within a burst and 100ms between
+ * bursts. The environment of each uevent carries ACTION, DEVPATH and
+ * SUBSYSTEM, plus POWER_SUPPLY_NAME for power_supply ones.
+ */
+bool writeUeventLog(const std::string &path, const std::vector<UeventBurst> &bursts);
+
+#endif  // VENDOR_QCOM_USB_TESTS_FAKE_FS_TREE_H
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VENDOR_QCOM_USB_TESTS_TEST_CALLBACKS_H
+#define VENDOR_QCOM_USB_TESTS_TEST_CALLBACKS_H
+
+#include <android/hardware/usb/1.2/IUsbCallback.h>
+#include <android/hardware/usb/gadget/1.0/IUsbGadgetCallback.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+/*
+ * In-process callbacks that keep the last report and count them, so that
+ * a caller can wait for the report its call caused.
+ */
+template <typename T>
+class Reports {
+ public:
+  void post(const T &report) {
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      mLast = report;
+      mCount++;
+    }
+    mCv.notify_all();
+  }
+
+  // Waits until more than count reports were posted, false on timeout.
+  bool waitPast(uint64_t count, T *last, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    if (!mCv.wait_for(lock, timeout, [this, count] { return mCount > count; }))
+      return false;
+    if (last != NULL)
+      *last = mLast;
+    return true;
+  }
+
+  uint64_t count() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mCount;
+  }
+
+ private:
+  std::mutex mLock;
+  std::condition_variable mCv;
+  T mLast;
+  uint64_t mCount = 0;
+};
+
+struct PortStatusReport {
+  ::android::hardware::hidl_vec<::android::hardware::usb::V1_2::PortStatus> ports;
+  ::android::hardware::usb::V1_0::Status status;
+};
+
+struct UsbCallback : public ::android::hardware::usb::V1_2::IUsbCallback {
+  ::android::hardware::Return<void> notifyPortStatusChange(
+      const ::android::hardware::hidl_vec<::android::hardware::usb::V1_0::PortStatus> &,
+      ::android::hardware::usb::V1_0::Status) override {
+    return ::android::hardware::Void();
+  }
+
+  ::android::hardware::Return<void> notifyPortStatusChange_1_1(
+      const ::android::hardware::hidl_vec<::android::hardware::usb::V1_1::PortStatus_1_1> &,
+      ::android::hardware::usb::V1_0::Status) override {
+    return ::android::hardware::Void();
+  }
+
+  ::android::hardware::Return<void> notifyPortStatusChange_1_2(
+      const ::android::hardware::hidl_vec<::android::hardware::usb::V1_2::PortStatus> &ports,
+      ::android::hardware::usb::V1_0::Status status) override {
+    portStatus.post({ports, status});
+    return ::android::hardware::Void();
+  }
+
+  ::android::hardware::Return<void> notifyRoleSwitchStatus(
+      const ::android::hardware::hidl_string &, const ::android::hardware::usb::V1_0::PortRole &,
+      ::android::hardware::usb::V1_0::Status) override {
+    return ::android::hardware::Void();
+  }
+
+  Reports<PortStatusReport> portStatus;
+};
+
+struct FunctionsReport {
+  uint64_t functions;
+  ::android::hardware::usb::gadget::V1_0::Status status;
+};
+
+struct UsbGadgetCallback : public ::android::hardware::usb::gadget::V1_0::IUsbGadgetCallback {
+  ::android::hardware::Return<void> setCurrentUsbFunctionsCb(
+      uint64_t functions, ::android::hardware::usb::gadget::V1_0::Status status) override {
+    setFunctions.post({functions, status});
+    return ::android::hardware::Void();
+  }
+
+  ::android::hardware::Return<void> getCurrentUsbFunctionsCb(
+      uint64_t, ::android::hardware::usb::gadget::V1_0::Status) override {
+    return ::android::hardware::Void();
+  }
+
+  Reports<FunctionsReport> setFunctions;
+};
+
+#endif  // VENDOR_QCOM_USB_TESTS_TEST_CALLBACKS_H
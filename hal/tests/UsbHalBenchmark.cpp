@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <string.h>
+
+#include "FakeFsTree.h"
+#include "TestCallbacks.h"
+#include "Usb.h"
+#include "UeventRegex.h"
+#include "UsbGadget.h"
+
+using namespace std::chrono_literals;
+using android::sp;
+using android::hardware::usb::V1_2::implementation::UeventReplay;
+using android::hardware::usb::V1_2::implementation::Usb;
+using android::hardware::usb::V1_2::implementation::matchUsbUevent;
+using android::hardware::usb::V1_2::implementation::replayUeventsDryRun;
+using android::hardware::usb::gadget::V1_0::GadgetFunction;
+using android::hardware::usb::gadget::V1_0::implementation::UsbGadget;
+
+// Served from the published snapshot, see Usb::queryPortStatus().
+static void BM_QueryPortStatus(benchmark::State &state) {
+  FakeFsTree tree;
+  tree.addTypecPorts(state.range(0), state.range(0));
+
+  sp<Usb> usb = new Usb();
+  sp<UsbCallback> callback = new UsbCallback();
+  usb->setCallback(callback);
+
+  for (auto _ : state)
+    usb->queryPortStatus();
+
+  state.SetItemsProcessed(state.iterations());
+  usb->setCallback(NULL);
+}
+BENCHMARK(BM_QueryPortStatus)->RangeMultiplier(2)->Range(1, MAX_TYPEC_PORTS);
+
+/*
+ * The corpus followed by a partner coming and going on each port, replayed
+ * at full speed through the dispatch of the worker. The time is that of
+ * the replay itself, the scratch instance is set up in between.
+ */
+static void BM_ReplayUevents(benchmark::State &state) {
+  FakeFsTree tree;
+  tree.addTypecPorts(state.range(0), state.range(0));
+  sp<Usb> usb = new Usb();
+
+  std::vector<UeventBurst> bursts = loadUeventCorpus();
+  if (bursts.empty()) {
+    state.SkipWithError("uevent_corpus.txt missing");
+    return;
+  }
+  for (int i = 0; i < state.range(0); i++) {
+    std::string port = "@" TYPEC_DEVICE_PATH "/typec/port" + std::to_string(i);
+    std::string partner = port + "/port" + std::to_string(i) + "-partner";
+
+    bursts.push_back({"add" + partner, "change" + port});
+    bursts.push_back({"remove" + partner, "change" + port});
+  }
+
+  std::string log = tree.root() + "/uevents.log";
+  if (!writeUeventLog(log, bursts)) {
+    state.SkipWithError("cannot write the uevent log");
+    return;
+  }
+
+  uint64_t uevents = 0;
+  for (auto _ : state) {
+    UeventReplay replay;
+    replay.path = log;
+    replayUeventsDryRun(usb.get(), &replay, UEVENT_DEBOUNCE_MS);
+    if (replay.result) {
+      state.SkipWithError("replay failed");
+      break;
+    }
+    state.SetIterationTime(replay.elapsedUs / 1e6);
+    uevents += replay.events;
+  }
+
+  state.SetItemsProcessed(uevents);
+}
+BENCHMARK(BM_ReplayUevents)->RangeMultiplier(2)->Range(1, MAX_TYPEC_PORTS)->UseManualTime();
+
+/*
+ * Alternates between two compositions that share ffs.adb, which is the
+ * reconfiguration the framework does on every MTP/PTP toggle, up to the
+ * callback. No host is attached so there is no disconnect wait. Most of
+ * the work is on the worker, hence real time.
+ */
+static void BM_SetCurrentUsbFunctions(benchmark::State &state) {
+  static const uint64_t compositions[] = {
+    static_cast<uint64_t>(GadgetFunction::MTP | GadgetFunction::ADB),
+    static_cast<uint64_t>(GadgetFunction::PTP | GadgetFunction::ADB),
+  };
+  FakeFsTree tree;
+  tree.addPrimaryGadget();
+
+  sp<UsbGadget> gadget = new UsbGadget();
+  sp<UsbGadgetCallback> callback = new UsbGadgetCallback();
+  size_t next = 0;
+
+  for (auto _ : state) {
+    uint64_t count = callback->setFunctions.count();
+    FunctionsReport report;
+
+    gadget->setCurrentUsbFunctions(compositions[next], callback, 2500);
+    if (!callback->setFunctions.waitPast(count, &report, 5s) ||
+        report.status != android::hardware::usb::gadget::V1_0::Status::SUCCESS) {
+      state.SkipWithError("composition not applied");
+      break;
+    }
+    next = (next + 1) % 2;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  gadget.clear();
+}
+BENCHMARK(BM_SetCurrentUsbFunctions)->UseRealTime();
+
+/*
+ * The uevents of the corpus that dispatchUevent() matches against the add
+ * and bind patterns, which is all but the typec and power_supply ones.
+ */
+static std::vector<std::string> usbUeventCandidates() {
+  std::vector<std::string> uevents;
+
+  for (const auto &burst : loadUeventCorpus())
+    for (const auto &uevent : burst)
+      if (!strstr(uevent.c_str(), "typec/port") && !strstr(uevent.c_str(), "power_supply/usb"))
+        uevents.push_back(uevent);
+
+  return uevents;
+}
+
+static void BM_MatchUsbUevent(benchmark::State &state) {
+  std::vector<std::string> uevents = usbUeventCandidates();
+  std::string_view devpath, intf;
+  size_t matched = 0;
+
+  for (auto _ : state) {
+    for (const auto &uevent : uevents) {
+      matched += matchUsbUevent(uevent.c_str(), "add", &devpath, NULL) ||
+                 matchUsbUevent(uevent.c_str(), "bind", &devpath, &intf);
+      benchmark::DoNotOptimize(devpath);
+    }
+  }
+
+  benchmark::DoNotOptimize(matched);
+  state.SetItemsProcessed(state.iterations() * uevents.size());
+}
+BENCHMARK(BM_MatchUsbUevent);
+
+// The std::regex matching that matchUsbUevent() replaced, for comparison
+static void BM_RegexMatchUsbUevent(benchmark::State &state) {
+  std::vector<std::string> uevents = usbUeventCandidates();
+  std::cmatch match;
+  size_t matched = 0;
+
+  for (auto _ : state) {
+    for (const auto &uevent : uevents) {
+      matched += std::regex_match(uevent.c_str(), match, addUeventRegex()) ||
+                 std::regex_match(uevent.c_str(), match, bindUeventRegex());
+      benchmark::DoNotOptimize(match);
+    }
+  }
+
+  benchmark::DoNotOptimize(matched);
+  state.SetItemsProcessed(state.iterations() * uevents.size());
+}
+BENCHMARK(BM_RegexMatchUsbUevent);
+
+BENCHMARK_MAIN();
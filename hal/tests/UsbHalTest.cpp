@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2021, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "FakeFsTree.h"
+#include "FsRoot.h"
+#include "TestCallbacks.h"
+#include "Usb.h"
+#include "UeventRegex.h"
+#include "UsbGadget.h"
+
+using namespace std::chrono_literals;
+using android::sp;
+using android::hardware::hidl_vec;
+using android::hardware::usb::V1_0::PortDataRole;
+using android::hardware::usb::V1_0::PortPowerRole;
+using android::hardware::usb::V1_0::Status;
+using android::hardware::usb::V1_2::PortStatus;
+using android::hardware::usb::V1_2::implementation::UeventReplay;
+using android::hardware::usb::V1_2::implementation::Usb;
+using android::hardware::usb::V1_2::implementation::matchUsbUevent;
+using android::hardware::usb::V1_2::implementation::replayUeventsDryRun;
+using android::hardware::usb::gadget::V1_0::GadgetFunction;
+using android::hardware::usb::gadget::V1_0::implementation::UsbGadget;
+namespace gadget = android::hardware::usb::gadget::V1_0;
+
+TEST(FakeFsTreeTest, RootsHalPaths) {
+  std::string root;
+  {
+    FakeFsTree tree;
+    root = tree.root();
+    EXPECT_EQ(fsPath("/sys/class/typec"), root + "/sys/class/typec");
+
+    tree.addTypecPorts(2, 1);
+    char target[256];
+    ssize_t n = readlink((root + "/sys/class/typec/port0-partner").c_str(), target,
+                         sizeof(target) - 1);
+    ASSERT_GT(n, 0);
+    target[n] = '\0';
+    EXPECT_EQ(std::string(target), "../.." TYPEC_DEVICE_PATH "/typec/port0/port0-partner");
+    EXPECT_NE(access((root + "/sys/class/typec/port1/power_role").c_str(), R_OK), -1);
+    EXPECT_EQ(access((root + "/sys/class/typec/port1-partner").c_str(), F_OK), -1);
+  }
+  EXPECT_EQ(fsRoot(), "");
+  EXPECT_EQ(access(root.c_str(), F_OK), -1);
+}
+
+// Checks matchUsbUevent() against the regex on msg, for add and for bind
+static void expectMatchesRegex(const std::string &msg) {
+  std::string_view devpath, intf;
+  std::cmatch match;
+
+  bool matched = matchUsbUevent(msg.c_str(), "add", &devpath, NULL);
+  ASSERT_EQ(matched, std::regex_match(msg.c_str(), match, addUeventRegex())) << msg;
+  if (matched)
+    EXPECT_EQ(std::string(devpath), match[1].str()) << msg;
+
+  matched = matchUsbUevent(msg.c_str(), "bind", &devpath, &intf);
+  ASSERT_EQ(matched, std::regex_match(msg.c_str(), match, bindUeventRegex())) << msg;
+  if (matched) {
+    EXPECT_EQ(std::string(devpath), match[1].str()) << msg;
+    EXPECT_EQ(std::string(intf), match[2].str()) << msg;
+  }
+}
+
+TEST(MatchUsbUeventTest, MatchesLikeTheRegex) {
+  std::vector<UeventBurst> corpus = loadUeventCorpus();
+  ASSERT_FALSE(corpus.empty());
+
+  size_t adds = 0, binds = 0;
+  for (const auto &burst : corpus) {
+    for (const auto &uevent : burst) {
+      std::string devpath = uevent.substr(uevent.find('@'));
+
+      // Every DEVPATH as an add and a bind, cut short everywhere and with
+      // every character replaced by ones the patterns care about.
+      for (const std::string &msg : {uevent, "add" + devpath, "bind" + devpath}) {
+        std::string_view unused;
+        adds += matchUsbUevent(msg.c_str(), "add", &unused, NULL);
+        binds += matchUsbUevent(msg.c_str(), "bind", &unused, &unused);
+
+        for (size_t i = 0; i <= msg.size(); i++) {
+          expectMatchesRegex(msg.substr(0, i));
+          if (i == msg.size())
+            break;
+          for (char c : {'0', '9', 'x', '.', '-', '/', ':', '@'}) {
+            std::string mutated = msg;
+            mutated[i] = c;
+            expectMatchesRegex(mutated);
+          }
+        }
+        if (HasFatalFailure())
+          return;
+      }
+    }
+  }
+
+  // The corpus does exercise both patterns.
+  EXPECT_GT(adds, 0u);
+  EXPECT_GT(binds, 0u);
+}
+
+class UsbTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    if (mUsb != NULL)
+      mUsb->setCallback(NULL);
+  }
+
+  // Registers a callback on a new HAL and returns the first report
+  PortStatusReport start() {
+    PortStatusReport report;
+
+    mUsb = new Usb();
+    mCallback = new UsbCallback();
+    mUsb->setCallback(mCallback);
+    mUsb->queryPortStatus();
+    EXPECT_TRUE(mCallback->portStatus.waitPast(0, &report, 1s));
+    std::sort(report.ports.begin(), report.ports.end(),
+              [](const PortStatus &a, const PortStatus &b) {
+                return std::string(a.status_1_1.status.portName) <
+                       std::string(b.status_1_1.status.portName);
+              });
+    return report;
+  }
+
+  FakeFsTree mTree;
+  sp<Usb> mUsb;
+  sp<UsbCallback> mCallback;
+};
+
+TEST_F(UsbTest, ReportsEveryPort) {
+  mTree.addTypecPorts(4, 2);
+
+  PortStatusReport report = start();
+  EXPECT_EQ(report.status, Status::SUCCESS);
+  ASSERT_EQ(report.ports.size(), 4u);
+  for (size_t i = 0; i < report.ports.size(); i++) {
+    const auto &status = report.ports[i].status_1_1.status;
+    bool partner = i < 2;
+
+    EXPECT_EQ(std::string(status.portName), "port" + std::to_string(i));
+    EXPECT_EQ(status.currentPowerRole, partner ? PortPowerRole::SINK : PortPowerRole::NONE);
+    EXPECT_EQ(status.currentDataRole, partner ? PortDataRole::DEVICE : PortDataRole::NONE);
+    EXPECT_EQ(status.canChangeDataRole, partner);
+  }
+}
+
+TEST_F(UsbTest, QueryServesTheSnapshot) {
+  mTree.addTypecPorts(1, 1);
+  start();
+
+  // Not re-read on a query, only once uevents say that it changed.
+  mTree.removePartner(0);
+  uint64_t count = mCallback->portStatus.count();
+  PortStatusReport report;
+  mUsb->queryPortStatus();
+  ASSERT_TRUE(mCallback->portStatus.waitPast(count, &report, 1s));
+  ASSERT_EQ(report.ports.size(), 1u);
+  EXPECT_EQ(report.ports[0].status_1_1.status.currentDataRole, PortDataRole::DEVICE);
+}
+
+TEST_F(UsbTest, ReplayLeavesTheTreeAlone) {
+  mTree.addTypecPorts(2, 2);
+  mTree.writeFile("/sys" TYPEC_DEVICE_PATH "/typec/port0/power_operation_mode",
+                  "usb_power_delivery\n");
+  mTree.writeFile(GADGET_MAX_POWER_PATH, "900\n");
+
+  std::vector<UeventBurst> corpus = loadUeventCorpus();
+  ASSERT_FALSE(corpus.empty());
+  uint64_t uevents = 0;
+  for (const auto &burst : corpus)
+    uevents += burst.size();
+
+  UeventReplay replay;
+  replay.path = mTree.root() + "/uevents.log";
+  ASSERT_TRUE(writeUeventLog(replay.path, corpus));
+  replayUeventsDryRun(mUsb.get(), &replay, UEVENT_DEBOUNCE_MS);
+
+  EXPECT_EQ(replay.result, 0);
+  EXPECT_EQ(replay.events, uevents);
+  EXPECT_GT(replay.handled, 0u);
+  EXPECT_LT(replay.handled, uevents);
+  // port0 is in PD mode, the live instance would report self-powered.
+  std::string maxPower;
+  ASSERT_TRUE(mTree.readFile(GADGET_MAX_POWER_PATH, &maxPower));
+  EXPECT_EQ(maxPower, "900\n");
+}
+
+TEST_F(UsbTest, ReplayRejectsForeignLogs) {
+  UeventReplay replay;
+  replay.path = mTree.root() + "/uevents.log";
+  ASSERT_TRUE(mTree.writeFile("/uevents.log", "USBUEVT0"));
+  replayUeventsDryRun(mUsb.get(), &replay, UEVENT_DEBOUNCE_MS);
+  EXPECT_EQ(replay.result, EINVAL);
+  EXPECT_EQ(replay.events, 0u);
+}
+
+class UsbGadgetTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    mUdc = mTree.addPrimaryGadget();
+    mGadget = new UsbGadget();
+    mCallback = new UsbGadgetCallback();
+  }
+
+  void TearDown() override {
+    // Joins the worker and the monitor before the tree goes away.
+    mGadget.clear();
+  }
+
+  FunctionsReport apply(uint64_t functions) {
+    FunctionsReport report = {};
+    uint64_t count = mCallback->setFunctions.count();
+
+    mGadget->setCurrentUsbFunctions(functions, mCallback, 2500);
+    EXPECT_TRUE(mCallback->setFunctions.waitPast(count, &report, 5s));
+    return report;
+  }
+
+  std::string read(const std::string &attr) {
+    std::string value;
+    mTree.readFile("/config/usb_gadget/g1/" + attr, &value);
+    return value;
+  }
+
+  FakeFsTree mTree;
+  std::string mUdc;
+  sp<UsbGadget> mGadget;
+  sp<UsbGadgetCallback> mCallback;
+};
+
+static const uint64_t kMtpAdb = static_cast<uint64_t>(GadgetFunction::MTP | GadgetFunction::ADB);
+static const uint64_t kPtpAdb = static_cast<uint64_t>(GadgetFunction::PTP | GadgetFunction::ADB);
+
+TEST_F(UsbGadgetTest, SetsUpComposition) {
+  FunctionsReport report = apply(kMtpAdb);
+  EXPECT_EQ(report.functions, kMtpAdb);
+  EXPECT_EQ(report.status, gadget::Status::SUCCESS);
+  EXPECT_EQ(read("idProduct"), "0x4ee2");
+  EXPECT_EQ(read("UDC"), mUdc);
+  EXPECT_NE(access(fsPath("/config/usb_gadget/g1/configs/b.1/function0").c_str(), F_OK), -1);
+  EXPECT_NE(access(fsPath("/config/usb_gadget/g1/configs/b.1/function1").c_str(), F_OK), -1);
+  EXPECT_EQ(access(fsPath("/config/usb_gadget/g1/configs/b.1/function2").c_str(), F_OK), -1);
+  EXPECT_EQ(mGadget->mCurrentUsbFunctions, kMtpAdb);
+}
+
+TEST_F(UsbGadgetTest, SwitchesComposition) {
+  ASSERT_EQ(apply(kMtpAdb).status, gadget::Status::SUCCESS);
+
+  FunctionsReport report = apply(kPtpAdb);
+  EXPECT_EQ(report.functions, kPtpAdb);
+  EXPECT_EQ(report.status, gadget::Status::SUCCESS);
+  EXPECT_EQ(read("idProduct"), "0x4ee6");
+  EXPECT_EQ(access(fsPath("/config/usb_gadget/g1/configs/b.1/function2").c_str(), F_OK), -1);
+}
+
+TEST_F(UsbGadgetTest, WaitsForFfsEndpoints) {
+  mTree.remove("/dev/usb-ffs/adb/ep2");
+
+  FunctionsReport report = {};
+  uint64_t count = mCallback->setFunctions.count();
+  mGadget->setCurrentUsbFunctions(kMtpAdb, mCallback, 100);
+  ASSERT_TRUE(mCallback->setFunctions.waitPast(count, &report, 5s));
+  EXPECT_EQ(report.status, gadget::Status::ERROR);
+  EXPECT_NE(read("UDC"), mUdc);
+
+  // Pulled up once the daemon gets to it.
+  mTree.writeFile("/dev/usb-ffs/adb/ep2", "");
+  for (int i = 0; i < 100 && read("UDC") != mUdc; i++)
+    usleep(10000);
+  EXPECT_EQ(read("UDC"), mUdc);
+}
+
+TEST_F(UsbGadgetTest, DropsSnapshotWithTheComposition) {
+  std::string snapshot = fsPath("/data/vendor/usb/g1.snapshot");
+
+  ASSERT_EQ(apply(kMtpAdb).status, gadget::Status::SUCCESS);
+  EXPECT_NE(access(snapshot.c_str(), F_OK), -1);
+  EXPECT_EQ(apply(static_cast<uint64_t>(GadgetFunction::NONE)).status, gadget::Status::SUCCESS);
+  EXPECT_EQ(access(snapshot.c_str(), F_OK), -1);
+
+  // Nor is what a failed switch left behind brought back.
+  ASSERT_EQ(apply(kMtpAdb).status, gadget::Status::SUCCESS);
+  EXPECT_EQ(apply(kMtpAdb | 1ULL << 40).status,
+            gadget::Status::CONFIGURATION_NOT_SUPPORTED);
+  EXPECT_EQ(access(snapshot.c_str(), F_OK), -1);
+}
@@ -20,8 +20,10 @@ endif
 
 ifneq ($(TARGET_KERNEL_VERSION),$(filter $(TARGET_KERNEL_VERSION),4.9 4.14))
   PRODUCT_PACKAGES += android.hardware.usb@1.2-service-qti
+  PRODUCT_PACKAGES += usb_autosuspend.conf
 endif
 
 ifeq ($(TARGET_USES_USB_GADGET_HAL), true)
   PRODUCT_PACKAGES += android.hardware.usb.gadget@1.0-service-qti
+  PRODUCT_PACKAGES += usb_compositions.conf
 endif